@@ -15,6 +15,7 @@ git checkout -b $GOST_BRANCH tags/$CHROMIUM_TAG
 git checkout -f $GOST_BRANCH
 gclient sync --with_branch_heads
 git am --3way --ignore-space-change < $CHROMIUM_GOST_REPO/patch/chromium.patch || exit
+cp -f $CHROMIUM_GOST_REPO/src/gostssl_api.h net/ssl/gostssl_api.h
 cp -f $CHROMIUM_GOST_REPO/extra/exit_0.sh chrome/installer/linux/common/repo.cron
 cp -f $CHROMIUM_GOST_REPO/extra/exit_0.sh chrome/installer/linux/common/rpmrepo.cron
 
@@ -29,3 +30,4 @@ cd $BORINGSSL_PATH
 git checkout -b $GOST_BRANCH
 git checkout -f $GOST_BRANCH
 git am --3way --ignore-space-change < $CHROMIUM_GOST_REPO/patch/boringssl.patch || exit
+cp -f $CHROMIUM_GOST_REPO/src/gostssl_api.h ssl/gostssl_api.h
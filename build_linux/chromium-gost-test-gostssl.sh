@@ -0,0 +1,8 @@
+#!/bin/sh
+
+cd $(dirname $0)
+python3 ../src/gostssl_preload.py || exit 1
+g++ -Wall -std=c++11 -g -O2 -Werror -Wno-unused-function \
+    -Igostssl_stub/include -Igostssl_stub/cprocsp -Igostssl_stub/msspi \
+    gostssl_test.cpp -o gostssl_test -lpthread || exit 1
+./gostssl_test || exit 1
@@ -0,0 +1,65 @@
+// stand-in for the CryptoPro CSP headers gostssl.cpp builds against,
+// the subset of declarations it uses, for gostssl_test.cpp only
+
+#ifndef GOSTSSL_STUB_CSP_WINCRYPT_H
+#define GOSTSSL_STUB_CSP_WINCRYPT_H
+
+typedef struct
+{
+    LPSTR pszObjId;
+} CRYPT_ALGORITHM_IDENTIFIER;
+
+typedef struct
+{
+    DWORD dwLowDateTime;
+    DWORD dwHighDateTime;
+} FILETIME;
+
+typedef struct
+{
+    CRYPT_ALGORITHM_IDENTIFIER SignatureAlgorithm;
+    FILETIME NotBefore;
+    FILETIME NotAfter;
+} CERT_INFO, * PCERT_INFO;
+
+typedef struct
+{
+    DWORD dwCertEncodingType;
+    BYTE * pbCertEncoded;
+    DWORD cbCertEncoded;
+    PCERT_INFO pCertInfo;
+    HCERTSTORE hCertStore;
+} CERT_CONTEXT;
+
+typedef const CERT_CONTEXT * PCCERT_CONTEXT;
+
+#define X509_ASN_ENCODING 1
+#define PKCS_7_ASN_ENCODING 0x10000
+#define PROV_GOST_2001_DH 75
+#define PROV_GOST_2012_256 80
+#define CRYPT_VERIFYCONTEXT 0xF0000000
+#define CRYPT_SILENT 0x40
+#define CERT_STORE_PROV_SYSTEM_A ( (LPCSTR)9 )
+#define CERT_STORE_OPEN_EXISTING_FLAG 0x4000
+#define CERT_STORE_READONLY_FLAG 0x8000
+#define CERT_FIND_ANY 0
+#define CERT_DIGITAL_SIGNATURE_KEY_USAGE 0x80
+#define CERT_KEY_PROV_INFO_PROP_ID 2
+#define CERT_E_CRITICAL 0x800B0105L
+#define CERT_STORE_CTRL_RESYNC 1
+#define CERT_STORE_CTRL_NOTIFY_CHANGE 2
+#define CERT_STORE_CTRL_AUTO_RESYNC 4
+
+BOOL WINAPI CryptAcquireContext( HCRYPTPROV * phProv, LPCSTR szContainer, LPCSTR szProvider, DWORD dwProvType, DWORD dwFlags );
+BOOL WINAPI CryptReleaseContext( HCRYPTPROV hProv, DWORD dwFlags );
+PCCERT_CONTEXT WINAPI CertCreateCertificateContext( DWORD dwCertEncodingType, const BYTE * pbCertEncoded, DWORD cbCertEncoded );
+PCCERT_CONTEXT WINAPI CertDuplicateCertificateContext( PCCERT_CONTEXT pCertContext );
+BOOL WINAPI CertFreeCertificateContext( PCCERT_CONTEXT pCertContext );
+HCERTSTORE WINAPI CertOpenStore( LPCSTR lpszStoreProvider, DWORD dwEncodingType, HCRYPTPROV hCryptProv, DWORD dwFlags, const void * pvPara );
+BOOL WINAPI CertCloseStore( HCERTSTORE hCertStore, DWORD dwFlags );
+BOOL WINAPI CertControlStore( HCERTSTORE hCertStore, DWORD dwFlags, DWORD dwCtrlType, const void * pvCtrlPara );
+PCCERT_CONTEXT WINAPI CertFindCertificateInStore( HCERTSTORE hCertStore, DWORD dwCertEncodingType, DWORD dwFindFlags, DWORD dwFindType, const void * pvFindPara, PCCERT_CONTEXT pPrevCertContext );
+BOOL WINAPI CertGetIntendedKeyUsage( DWORD dwCertEncodingType, PCERT_INFO pCertInfo, BYTE * pbKeyUsage, DWORD cbKeyUsage );
+BOOL WINAPI CertGetCertificateContextProperty( PCCERT_CONTEXT pCertContext, DWORD dwPropId, void * pvData, DWORD * pcbData );
+
+#endif // GOSTSSL_STUB_CSP_WINCRYPT_H
@@ -0,0 +1,25 @@
+// stand-in for the CryptoPro CSP headers gostssl.cpp builds against,
+// the subset of declarations it uses, for gostssl_test.cpp only
+
+#ifndef GOSTSSL_STUB_CSP_WINDEF_H
+#define GOSTSSL_STUB_CSP_WINDEF_H
+
+#include <stdint.h>
+
+typedef uint32_t DWORD;
+typedef int BOOL;
+typedef unsigned char BYTE;
+typedef char CHAR;
+typedef char * LPSTR;
+typedef const char * LPCSTR;
+typedef void VOID;
+typedef long LONG;
+typedef uint64_t ULONGLONG;
+typedef uintptr_t HCRYPTPROV;
+typedef void * HCERTSTORE;
+
+#define TRUE 1
+#define FALSE 0
+#define WINAPI
+
+#endif // GOSTSSL_STUB_CSP_WINDEF_H
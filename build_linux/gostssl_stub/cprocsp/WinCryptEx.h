@@ -0,0 +1,11 @@
+// stand-in for the CryptoPro CSP headers gostssl.cpp builds against,
+// the subset of declarations it uses, for gostssl_test.cpp only
+
+#ifndef GOSTSSL_STUB_WINCRYPTEX_H
+#define GOSTSSL_STUB_WINCRYPTEX_H
+
+#define szOID_CP_GOST_R3411_R3410EL "1.2.643.2.2.3"
+#define szOID_CP_GOST_R3411_12_256_R3410 "1.2.643.7.1.1.3.2"
+#define szOID_CP_GOST_R3411_12_512_R3410 "1.2.643.7.1.1.3.3"
+
+#endif // GOSTSSL_STUB_WINCRYPTEX_H
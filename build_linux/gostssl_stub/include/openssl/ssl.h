@@ -0,0 +1,55 @@
+// stand-in for the boringssl headers gostssl.cpp builds against,
+// the subset of declarations it uses, for gostssl_test.cpp only
+
+#ifndef GOSTSSL_STUB_SSL_H
+#define GOSTSSL_STUB_SSL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define GOSTSSL
+
+typedef struct bio_st BIO;
+typedef struct ssl_st SSL;
+typedef struct ssl_cipher_st SSL_CIPHER;
+typedef struct crypto_buffer_st CRYPTO_BUFFER;
+typedef struct crypto_buffer_pool_st CRYPTO_BUFFER_POOL;
+typedef struct stack_st _STACK;
+typedef struct crypto_ex_data_st CRYPTO_EX_DATA;
+typedef void CRYPTO_EX_free( void * parent, void * ptr, CRYPTO_EX_DATA * ad, int index, long argl, void * argp );
+typedef int CRYPTO_EX_dup( CRYPTO_EX_DATA * to, const CRYPTO_EX_DATA * from, void ** from_d, int index, long argl, void * argp );
+typedef void CRYPTO_EX_unused;
+
+#define STACK_OF( type ) struct stack_st_##type
+#define CHECKED_CAST( to, from, p ) ( (to)( p ) )
+struct stack_st_CRYPTO_BUFFER;
+
+#define SSL_ST_INIT 1
+#define SSL_ST_CONNECT 2
+#define SSL_ST_OK 3
+#define SSL_CB_HANDSHAKE_DONE 0x20
+
+#define SSL_NOTHING 1
+#define SSL_WRITING 2
+#define SSL_READING 3
+#define SSL_X509_LOOKUP 4
+
+#define SSL3_VERSION 0x0300
+#define TLS1_VERSION 0x0301
+#define TLS1_1_VERSION 0x0302
+#define TLS1_2_VERSION 0x0303
+#define TLS1_3_VERSION 0x0304
+#define TLS1_3_DRAFT_VERSION 0x7f12
+
+#define ERR_LIB_SSL 16
+#define SSL_R_SERVER_CERT_CHANGED 218
+#define SSL_R_TLS_GOST_REQUIRED 3072
+
+struct ssl_cipher_st
+{
+    const char * name;
+    const char * standard_name;
+    uint32_t id;
+};
+
+#endif // GOSTSSL_STUB_SSL_H
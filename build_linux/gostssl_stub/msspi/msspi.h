@@ -0,0 +1,49 @@
+// stand-in for msspi.h, the subset of declarations gostssl.cpp uses,
+// for gostssl_test.cpp only
+
+#ifndef GOSTSSL_STUB_MSSPI_H
+#define GOSTSSL_STUB_MSSPI_H
+
+#include <stddef.h>
+
+typedef struct MSSPI * MSSPI_HANDLE;
+typedef int ( * msspi_read_cb )( void * cb_arg, void * buf, int len );
+typedef int ( * msspi_write_cb )( void * cb_arg, const void * buf, int len );
+typedef int ( * msspi_cert_cb )( void * cb_arg );
+
+typedef struct
+{
+    DWORD dwVersion;
+    DWORD dwProtocol;
+    DWORD dwCipherSuite;
+} SecPkgContext_CipherInfo, * PSecPkgContext_CipherInfo;
+
+MSSPI_HANDLE msspi_open( void * cb_arg, msspi_read_cb read_cb, msspi_write_cb write_cb );
+void msspi_close( MSSPI_HANDLE h );
+int msspi_set_hostname( MSSPI_HANDLE h, const char * hostName );
+int msspi_set_cachestring( MSSPI_HANDLE h, const char * cachestring );
+int msspi_set_alpn( MSSPI_HANDLE h, const uint8_t * alpn, unsigned len );
+int msspi_set_mycert( MSSPI_HANDLE h, const char * clientCert, int len );
+void msspi_set_cert_cb( MSSPI_HANDLE h, msspi_cert_cb cb );
+int msspi_connect( MSSPI_HANDLE h );
+int msspi_read( MSSPI_HANDLE h, void * buf, int len );
+int msspi_write( MSSPI_HANDLE h, const void * buf, int len );
+int msspi_state( MSSPI_HANDLE h );
+const char * msspi_get_alpn( MSSPI_HANDLE h );
+PSecPkgContext_CipherInfo msspi_get_cipherinfo( MSSPI_HANDLE h );
+int msspi_get_peercerts( MSSPI_HANDLE h, const char ** bufs, int * lens, size_t * count );
+int msspi_get_issuerlist( MSSPI_HANDLE h, const char ** bufs, int * lens, size_t * count );
+unsigned msspi_verify( MSSPI_HANDLE h );
+
+#define MSSPI_READING 0x1
+#define MSSPI_WRITING 0x2
+#define MSSPI_X509_LOOKUP 0x4
+#define MSSPI_SENT_SHUTDOWN 0x10
+#define MSSPI_RECEIVED_SHUTDOWN 0x20
+#define MSSPI_LAST_PROC_WRITE 0x40
+#define MSSPI_ERROR 0x1000
+
+#define MSSPI_VERIFY_OK 0x1
+#define MSSPI_VERIFY_ERROR 0x2
+
+#endif // GOSTSSL_STUB_MSSPI_H
@@ -0,0 +1,135 @@
+// stand-in for boringssl's ssl/internal.h, the members gostssl.cpp
+// reaches into, followed by the gostssl method tables exactly as
+// patch/boringssl.patch adds them
+
+#ifndef GOSTSSL_STUB_INTERNAL_H
+#define GOSTSSL_STUB_INTERNAL_H
+
+#include <openssl/ssl.h>
+
+struct ssl_aead_ctx_st
+{
+    const SSL_CIPHER * cipher;
+};
+
+typedef struct ssl_aead_ctx_st SSL_AEAD_CTX;
+
+struct ssl_session_st
+{
+    uint16_t ssl_version;
+    const SSL_CIPHER * cipher;
+    STACK_OF( CRYPTO_BUFFER ) * certs;
+};
+
+typedef struct ssl_session_st SSL_SESSION;
+
+struct ssl_handshake_st
+{
+    STACK_OF( CRYPTO_BUFFER ) * ca_names;
+    const SSL_CIPHER * new_cipher;
+    int state;
+    SSL_SESSION * new_session;
+};
+
+typedef struct ssl_handshake_st SSL_HANDSHAKE;
+
+struct ssl3_state_st
+{
+    SSL_HANDSHAKE * hs;
+    SSL_SESSION * established_session;
+    SSL_AEAD_CTX * aead_write_ctx;
+    uint8_t * alpn_selected;
+    size_t alpn_selected_len;
+    unsigned have_version : 1;
+};
+
+struct cert_st
+{
+    int ( * cert_cb )( SSL *, void * );
+    void * cert_cb_arg;
+};
+
+struct ssl_ctx_st
+{
+    CRYPTO_BUFFER_POOL * pool;
+    void ( * info_callback )( const SSL *, int, int );
+};
+
+struct ssl_st
+{
+    BIO * rbio;
+    BIO * wbio;
+    cert_st * cert;
+    ssl3_state_st * s3;
+    ssl_ctx_st * ctx;
+    char * tlsext_hostname;
+    uint8_t * alpn_client_proto_list;
+    unsigned alpn_client_proto_list_len;
+    uint16_t version;
+    int rwstate;
+    void ( * info_callback )( const SSL *, int, int );
+};
+
+#if defined(GOSTSSL)
+//
+#ifndef _WIN32
+#define EXPLICITSSL_CALL
+#else
+#if defined ( _M_IX86 )
+#define EXPLICITSSL_CALL __cdecl
+#elif defined ( _M_X64 )
+#define EXPLICITSSL_CALL __fastcall
+#endif
+#endif // _WIN32
+//
+struct boringssl_method_st
+{
+    void *   ( EXPLICITSSL_CALL * BORINGSSL_malloc )( size_t size );
+    void     ( EXPLICITSSL_CALL * BORINGSSL_free )( void * ptr );
+    int      ( EXPLICITSSL_CALL * BIO_read )( BIO * bio, void * data, int len );
+    int      ( EXPLICITSSL_CALL * BIO_write )( BIO * bio, const void * data, int len );
+    long     ( EXPLICITSSL_CALL * BIO_ctrl )( BIO * bio, int cmd, long larg, void * parg );
+    _STACK * ( EXPLICITSSL_CALL * sk_new_null )( void );
+    size_t   ( EXPLICITSSL_CALL * sk_push )( _STACK * sk, void * p );
+    int      ( EXPLICITSSL_CALL * ssl_get_new_session )( SSL_HANDSHAKE * hs, int is_server );
+    void     ( EXPLICITSSL_CALL * ERR_clear_error )( void );
+    void     ( EXPLICITSSL_CALL * ERR_put_error )( int, int, int, const char * file, unsigned line );
+    const SSL_CIPHER * ( EXPLICITSSL_CALL * SSL_get_cipher_by_value )( uint16_t value );
+    CRYPTO_BUFFER * ( EXPLICITSSL_CALL * CRYPTO_BUFFER_new )( const uint8_t * data, size_t len, CRYPTO_BUFFER_POOL * pool );
+    int      ( EXPLICITSSL_CALL * SSL_get_ex_new_index )( long argl, void * argp, CRYPTO_EX_unused * unused, CRYPTO_EX_dup * dup_unused, CRYPTO_EX_free * free_func );
+    int      ( EXPLICITSSL_CALL * SSL_set_ex_data )( SSL * ssl, int idx, void * data );
+    void *   ( EXPLICITSSL_CALL * SSL_get_ex_data )( const SSL * ssl, int idx );
+    void     ( EXPLICITSSL_CALL * gostssl_mark )( SSL * ssl, int is_gost );
+};
+//
+typedef struct boringssl_method_st BORINGSSL_METHOD;
+//
+struct gostssl_method_st
+{
+    int  ( EXPLICITSSL_CALL * init )( BORINGSSL_METHOD * bssl );
+    int  ( EXPLICITSSL_CALL * connect )( SSL * s, int * is_gost );
+    int  ( EXPLICITSSL_CALL * read )( SSL * s, void * buf, int len, int * is_gost );
+    int  ( EXPLICITSSL_CALL * write )( SSL * s, const void * buf, int len, int * is_gost );
+    void ( EXPLICITSSL_CALL * free )( SSL * s );
+    int ( EXPLICITSSL_CALL * tls_gost_required )( SSL * s );
+    int  ( EXPLICITSSL_CALL * csp_state )( void );
+    // optional
+    int  ( EXPLICITSSL_CALL * peek )( SSL * s, void * buf, int len, int * is_gost );
+    int  ( EXPLICITSSL_CALL * pending )( const SSL * s, int * is_gost );
+};
+//
+typedef struct gostssl_method_st GOSTSSL_METHOD;
+//
+GOSTSSL_METHOD * gostssl();
+//
+// gostssl_usable is false once gostssl found no usable CSP,
+// GOST suites are neither offered nor required then
+int gostssl_usable();
+//
+// gostssl_marked is true while |ssl| may still be driven by gostssl,
+// hooks skip the call into gostssl for unmarked connections
+int gostssl_marked( const SSL * ssl );
+//
+#endif
+
+#endif // GOSTSSL_STUB_INTERNAL_H
@@ -0,0 +1,2053 @@
+// gostssl behaviour test
+//
+// src/gostssl.cpp is built in with msspi, the CSP and the boringssl
+// methods stubbed, against the stand-in headers in gostssl_stub/, so no
+// chromium or CSP tree is needed; connections are driven through the
+// entry points boringssl calls, built and run by
+// chromium-gost-test-gostssl.sh, exits non-zero when a check fails
+
+#include "../src/gostssl.cpp"
+
+#include <sys/wait.h>
+
+// allocations
+//
+// operator new and BORINGSSL_malloc are counted on a thread while it sets
+// |g_alloc_counting|, the msspi stub and the scripted server pause the
+// count, what is left is what gostssl allocates
+
+static thread_local bool g_alloc_counting = false;
+static uint64_t g_allocs = 0;
+
+struct TEST_ALLOC_PAUSE
+{
+    TEST_ALLOC_PAUSE()
+    {
+        was = g_alloc_counting;
+        g_alloc_counting = false;
+    }
+
+    ~TEST_ALLOC_PAUSE()
+    {
+        g_alloc_counting = was;
+    }
+
+    bool was;
+};
+
+void * operator new( size_t size )
+{
+    if( g_alloc_counting )
+        g_allocs++;
+
+    void * p = malloc( size ? size : 1 );
+
+    if( !p )
+        throw std::bad_alloc();
+
+    return p;
+}
+
+// not inlined, gcc would take free() after operator new for a mismatch
+__attribute__(( noinline )) void operator delete( void * p ) noexcept
+{
+    free( p );
+}
+
+// server
+//
+// BIOs are a scripted server: each client flight it reads is answered
+// |rtt_ms| later, or on test_bio_deliver() while |is_held| is set; after
+// the handshake it streams |stream| bytes of records when nothing else
+// is due, and with |is_sink| set what the client writes is only counted;
+// with |is_tls13| set the server's Finished comes with its hello and
+// nothing answers the client's Finished
+
+static const char * g_flights[][2] =
+{
+    { "client-hello;", "server-hello;" },
+    { "client-finished;", "server-finished;" },
+};
+
+#define TEST_FLIGHTS ( sizeof( g_flights ) / sizeof( g_flights[0] ) )
+
+struct TEST_BIO
+{
+    TEST_BIO()
+    {
+        seen = 0;
+        rtt_ms = 0;
+        is_held = false;
+        is_foreign_write = false;
+        owner = std::this_thread::get_id();
+        stream = 0;
+        is_sink = false;
+        sunk = 0;
+        is_tls13 = false;
+    }
+
+    std::string out;
+    size_t seen;
+    std::deque< std::pair< uint64_t, std::string > > in;
+    unsigned rtt_ms;
+    bool is_held;
+    bool is_foreign_write;
+    std::thread::id owner;
+    uint64_t stream;
+    bool is_sink;
+    uint64_t sunk;
+    bool is_tls13;
+};
+
+// bytes copied by the BIO, the socket read in a real one
+static uint64_t g_bio_copied = 0;
+
+static void test_bio_deliver( TEST_BIO * b )
+{
+    for( size_t i = 0; i < b->in.size(); i++ )
+        b->in[i].first = 0;
+}
+
+static int test_bio_read( BIO * bio, void * data, int len )
+{
+    TEST_BIO * b = (TEST_BIO *)bio;
+
+    if( b->in.empty() && b->stream )
+    {
+        static const char records[64 * 1024] = { 0 };
+        size_t n = (size_t)len < sizeof( records ) ? (size_t)len : sizeof( records );
+
+        if( n > b->stream )
+            n = (size_t)b->stream;
+
+        memcpy( data, records, n );
+        b->stream -= n;
+        g_bio_copied += n;
+
+        return (int)n;
+    }
+
+    if( b->in.empty() || b->in.front().first > gostssl_time_us() / 1000 )
+        return -1;
+
+    std::string & front = b->in.front().second;
+    size_t n = front.size() < (size_t)len ? front.size() : (size_t)len;
+
+    memcpy( data, front.data(), n );
+    front.erase( 0, n );
+
+    if( front.empty() )
+        b->in.pop_front();
+
+    return (int)n;
+}
+
+static int test_bio_write( BIO * bio, const void * data, int len )
+{
+    TEST_BIO * b = (TEST_BIO *)bio;
+    TEST_ALLOC_PAUSE pause;
+
+    if( std::this_thread::get_id() != b->owner )
+        b->is_foreign_write = true;
+
+    if( b->is_sink )
+    {
+        b->sunk += len;
+        return len;
+    }
+
+    b->out.append( (const char *)data, len );
+
+    for( ;; )
+    {
+        size_t pos = std::string::npos;
+        size_t flight = 0;
+
+        for( size_t i = 0; i < TEST_FLIGHTS; i++ )
+        {
+            size_t p = b->out.find( g_flights[i][0], b->seen );
+
+            if( p < pos )
+            {
+                pos = p;
+                flight = i;
+            }
+        }
+
+        if( pos == std::string::npos )
+            break;
+
+        uint64_t at = b->is_held ? UINT64_MAX : gostssl_time_us() / 1000 + b->rtt_ms;
+
+        if( !b->is_tls13 || flight + 1 < TEST_FLIGHTS )
+            b->in.push_back( std::make_pair( at, std::string( g_flights[flight][1] ) ) );
+
+        b->seen = pos + strlen( g_flights[flight][0] );
+    }
+
+    return len;
+}
+
+// boringssl
+//
+// an SSL is allocated with room for what the stubbed methods keep for it
+
+struct TEST_SSL
+{
+    SSL s;
+    void * ex_data;
+    int mark;
+    TEST_BIO * bio;
+};
+
+static thread_local int g_ssl_error = 0;
+static SSL_CIPHER * g_ciphers[4];
+static SSL_CIPHER g_cipher_tls13;
+
+// TLS_GOSTR341112_256_WITH_KUZNYECHIK_MGM_L
+#define TEST_CIPHER_TLS13 0xC103
+static const uint16_t g_cipher_values[4] =
+{
+    TLS_GOST_CIPHER_2001, TLS_GOST_CIPHER_2012, TLS_GOST_CIPHER_KUZNYECHIK, TLS_GOST_CIPHER_MAGMA,
+};
+
+template< typename T >
+static void test_zalloc( T *& p )
+{
+    p = (T *)calloc( 1, sizeof( T ) );
+}
+
+static void * test_malloc( size_t size )
+{
+    if( g_alloc_counting )
+        g_allocs++;
+
+    return malloc( size );
+}
+
+static void test_free( void * ptr )
+{
+    free( ptr );
+}
+
+static long test_bio_ctrl( BIO * bio, int cmd, long larg, void * parg )
+{
+    return 0;
+}
+
+static char g_stack;
+
+static _STACK * test_sk_new_null()
+{
+    return (_STACK *)&g_stack;
+}
+
+static size_t test_sk_push( _STACK * sk, void * p )
+{
+    return 1;
+}
+
+static int test_get_new_session( SSL_HANDSHAKE * hs, int is_server )
+{
+    test_zalloc( hs->new_session );
+    return hs->new_session ? 1 : 0;
+}
+
+static void test_err_clear()
+{
+    g_ssl_error = 0;
+}
+
+static void test_err_put( int lib, int func, int reason, const char * file, unsigned line )
+{
+    g_ssl_error = reason;
+}
+
+// set for a boringssl that predates the RFC 9189 suites
+static bool g_ciphers_old = false;
+
+static const SSL_CIPHER * test_cipher_by_value( uint16_t value )
+{
+    if( g_ciphers_old && ( value == TLS_GOST_CIPHER_KUZNYECHIK || value == TLS_GOST_CIPHER_MAGMA ) )
+        return NULL;
+
+    for( size_t i = 0; i < 4; i++ )
+        if( g_cipher_values[i] == value )
+            return g_ciphers[i];
+
+    if( value == TEST_CIPHER_TLS13 )
+        return &g_cipher_tls13;
+
+    return NULL;
+}
+
+static CRYPTO_BUFFER * test_buffer_new( const uint8_t * data, size_t len, CRYPTO_BUFFER_POOL * pool )
+{
+    return (CRYPTO_BUFFER *)&g_stack;
+}
+
+static int test_ex_new_index( long argl, void * argp, CRYPTO_EX_unused * unused, CRYPTO_EX_dup * dup_unused, CRYPTO_EX_free * free_func )
+{
+    return 0;
+}
+
+static int test_set_ex_data( SSL * ssl, int idx, void * data )
+{
+    ( (TEST_SSL *)ssl )->ex_data = data;
+    return 1;
+}
+
+static void * test_get_ex_data( const SSL * ssl, int idx )
+{
+    return ( (const TEST_SSL *)ssl )->ex_data;
+}
+
+static void test_mark( SSL * ssl, int is_gost )
+{
+    ( (TEST_SSL *)ssl )->mark = is_gost;
+}
+
+static BORINGSSL_METHOD g_bssl;
+
+static void test_bssl_init()
+{
+    for( size_t i = 0; i < 4; i++ )
+        test_zalloc( g_ciphers[i] );
+
+    g_bssl.BORINGSSL_malloc = test_malloc;
+    g_bssl.BORINGSSL_free = test_free;
+    g_bssl.BIO_read = test_bio_read;
+    g_bssl.BIO_write = test_bio_write;
+    g_bssl.BIO_ctrl = test_bio_ctrl;
+    g_bssl.sk_new_null = test_sk_new_null;
+    g_bssl.sk_push = test_sk_push;
+    g_bssl.ssl_get_new_session = test_get_new_session;
+    g_bssl.ERR_clear_error = test_err_clear;
+    g_bssl.ERR_put_error = test_err_put;
+    g_bssl.SSL_get_cipher_by_value = test_cipher_by_value;
+    g_bssl.CRYPTO_BUFFER_new = test_buffer_new;
+    g_bssl.SSL_get_ex_new_index = test_ex_new_index;
+    g_bssl.SSL_set_ex_data = test_set_ex_data;
+    g_bssl.SSL_get_ex_data = test_get_ex_data;
+    g_bssl.gostssl_mark = test_mark;
+}
+
+static SSL * test_ssl_new( const char * hostname )
+{
+    TEST_SSL * t = (TEST_SSL *)calloc( 1, sizeof( TEST_SSL ) );
+    SSL * s = &t->s;
+
+    test_zalloc( s->s3 );
+    test_zalloc( s->s3->hs );
+    test_zalloc( s->ctx );
+    test_zalloc( s->cert );
+
+    s->s3->hs->state = SSL_ST_INIT;
+    s->tlsext_hostname = strdup( hostname );
+
+    t->bio = new TEST_BIO();
+    s->rbio = (BIO *)t->bio;
+    s->wbio = (BIO *)t->bio;
+
+    return s;
+}
+
+static void test_ssl_free( SSL * s )
+{
+    TEST_SSL * t = (TEST_SSL *)s;
+
+    gostssl_free( s );
+
+    free( s->s3->established_session );
+    free( s->s3->aead_write_ctx );
+    free( s->s3->alpn_selected );
+    free( s->s3->hs );
+    free( s->s3 );
+    free( s->ctx );
+    free( s->cert );
+    free( s->tlsext_hostname );
+    delete t->bio;
+    free( t );
+}
+
+static TEST_BIO * test_bio( SSL * s )
+{
+    return ( (TEST_SSL *)s )->bio;
+}
+
+// msspi
+//
+// a handshake is three steps: the client hello, the client's last flight
+// once the server's hello is in (a client certificate is asked for here),
+// the end once the server's Finished is in, with |is_tls13| set the
+// server's Finished comes with its hello and the client's last flight is
+// the end; each step takes |cost_us|,
+// the cipher and the peer chain are known after the server's hello;
+// application data is written to the BIO as is, records are read into
+// a buffer of msspi's own, as much as fits or, with |g_msspi_piecewise|,
+// a header and then the rest of the record, decrypted in place and
+// copied out to the caller, partial records are moved to the front of
+// the buffer
+
+struct MSSPI
+{
+    void * arg;
+    msspi_read_cb read;
+    msspi_write_cb write;
+    msspi_cert_cb cert_cb;
+    int step;
+    int state;
+    bool is_cert_requested;
+    bool is_tls13;
+    unsigned cost_us;
+    std::string in;
+    std::string peer;
+    std::string mycert;
+    SecPkgContext_CipherInfo cipher;
+    std::vector<char> cbuf;
+    size_t chead;
+    size_t ctail;
+    size_t plain;
+    size_t plain_left;
+};
+
+#define TEST_RECORD_HEADER 5
+#define TEST_MSSPI_BUFFER ( 64 * 1024 )
+
+// what new handles start with, set while no handshake runs
+static unsigned g_msspi_cost_us = 0;
+static unsigned g_msspi_close_us = 0;
+static bool g_msspi_cert_requested = false;
+static uint16_t g_msspi_suite = TLS_GOST_CIPHER_2012;
+static bool g_msspi_piecewise = false;
+static bool g_msspi_tls13 = false;
+static std::atomic<int> g_msspi_handles( 0 );
+// plaintext copied out, partial records moved
+static uint64_t g_msspi_copied = 0;
+static uint64_t g_msspi_moved = 0;
+
+// a record on the wire: header, plaintext, MAC of the suite
+static size_t test_record_size( uint16_t suite )
+{
+    size_t mac = suite == TLS_GOST_CIPHER_KUZNYECHIK ? 16 : suite == TLS_GOST_CIPHER_MAGMA ? 8 : 4;
+
+    return TEST_RECORD_HEADER + GOSTSSL_RECORD_MAX + mac;
+}
+
+MSSPI_HANDLE msspi_open( void * cb_arg, msspi_read_cb read_cb, msspi_write_cb write_cb )
+{
+    TEST_ALLOC_PAUSE pause;
+    MSSPI_HANDLE h = new MSSPI();
+
+    h->arg = cb_arg;
+    h->read = read_cb;
+    h->write = write_cb;
+    h->cert_cb = NULL;
+    h->step = 0;
+    h->state = 0;
+    h->is_cert_requested = g_msspi_cert_requested;
+    h->is_tls13 = g_msspi_tls13;
+    h->cost_us = g_msspi_cost_us;
+    h->peer = "peer-1";
+    memset( &h->cipher, 0, sizeof( h->cipher ) );
+    h->cipher.dwProtocol = 0x00000800 /*SP_PROT_TLS1_2_CLIENT*/;
+    h->cipher.dwCipherSuite = g_msspi_suite;
+
+    if( h->is_tls13 )
+    {
+        h->cipher.dwProtocol = 0x00002000 /*SP_PROT_TLS1_3_CLIENT*/;
+        h->cipher.dwCipherSuite = TEST_CIPHER_TLS13;
+    }
+    h->chead = 0;
+    h->ctail = 0;
+    h->plain = 0;
+    h->plain_left = 0;
+
+    g_msspi_handles++;
+
+    return h;
+}
+
+void msspi_close( MSSPI_HANDLE h )
+{
+    // releasing the context and credentials in the CSP
+    if( g_msspi_close_us )
+        std::this_thread::sleep_for( std::chrono::microseconds( g_msspi_close_us ) );
+
+    g_msspi_handles--;
+    delete h;
+}
+
+int msspi_set_hostname( MSSPI_HANDLE h, const char * hostName )
+{
+    return 1;
+}
+
+int msspi_set_cachestring( MSSPI_HANDLE h, const char * cachestring )
+{
+    return 1;
+}
+
+int msspi_set_alpn( MSSPI_HANDLE h, const uint8_t * alpn, unsigned len )
+{
+    return 1;
+}
+
+int msspi_set_mycert( MSSPI_HANDLE h, const char * clientCert, int len )
+{
+    h->mycert.assign( clientCert, len );
+    return 1;
+}
+
+void msspi_set_cert_cb( MSSPI_HANDLE h, msspi_cert_cb cb )
+{
+    h->cert_cb = cb;
+}
+
+int msspi_connect( MSSPI_HANDLE h )
+{
+    TEST_ALLOC_PAUSE pause;
+
+    int last = h->is_tls13 ? (int)TEST_FLIGHTS - 1 : (int)TEST_FLIGHTS;
+
+    while( h->step <= last )
+    {
+        if( h->step )
+        {
+            // the server's answer to our last flight
+            const char * expected = g_flights[h->step - 1][1];
+            size_t len = strlen( expected );
+
+            while( h->in.size() < len )
+            {
+                char buf[64];
+                int n = h->read( h->arg, buf, (int)( len - h->in.size() ) );
+
+                if( n <= 0 )
+                {
+                    h->state = MSSPI_READING;
+                    return -1;
+                }
+
+                h->in.append( buf, n );
+            }
+
+            if( h->in != expected )
+            {
+                h->state = MSSPI_ERROR;
+                return 0;
+            }
+        }
+
+        if( h->step == 1 && h->is_cert_requested )
+        {
+            if( h->cert_cb( h->arg ) <= 0 )
+            {
+                h->state = MSSPI_X509_LOOKUP;
+                return -1;
+            }
+
+            h->is_cert_requested = false;
+        }
+
+        if( h->cost_us )
+            std::this_thread::sleep_for( std::chrono::microseconds( h->cost_us ) );
+
+        if( h->step < (int)TEST_FLIGHTS )
+            h->write( h->arg, g_flights[h->step][0], (int)strlen( g_flights[h->step][0] ) );
+
+        h->in.clear();
+        h->step++;
+    }
+
+    h->state = 0;
+    return 1;
+}
+
+int msspi_read( MSSPI_HANDLE h, void * buf, int len )
+{
+    if( !h->plain_left )
+    {
+        size_t record = test_record_size( (uint16_t)h->cipher.dwCipherSuite );
+
+        if( h->cbuf.size() != TEST_MSSPI_BUFFER )
+            h->cbuf.resize( TEST_MSSPI_BUFFER );
+
+        while( h->ctail - h->chead < record )
+        {
+            if( h->chead )
+            {
+                memmove( &h->cbuf[0], &h->cbuf[h->chead], h->ctail - h->chead );
+                g_msspi_moved += h->ctail - h->chead;
+                h->ctail -= h->chead;
+                h->chead = 0;
+            }
+
+            size_t have = h->ctail - h->chead;
+            size_t want = h->cbuf.size() - h->ctail;
+
+            if( g_msspi_piecewise )
+                want = have < TEST_RECORD_HEADER ? TEST_RECORD_HEADER - have : record - have;
+
+            int n = h->read( h->arg, &h->cbuf[h->ctail], (int)want );
+
+            if( n <= 0 )
+            {
+                h->state = MSSPI_READING;
+                return -1;
+            }
+
+            h->ctail += n;
+        }
+
+        h->plain = h->chead + TEST_RECORD_HEADER;
+        h->plain_left = GOSTSSL_RECORD_MAX;
+        h->chead += record;
+    }
+
+    size_t n = h->plain_left < (size_t)len ? h->plain_left : (size_t)len;
+
+    memcpy( buf, &h->cbuf[h->plain], n );
+    h->plain += n;
+    h->plain_left -= n;
+    g_msspi_copied += n;
+    h->state = 0;
+
+    return (int)n;
+}
+
+int msspi_write( MSSPI_HANDLE h, const void * buf, int len )
+{
+    return h->write( h->arg, buf, len );
+}
+
+int msspi_state( MSSPI_HANDLE h )
+{
+    return h->state;
+}
+
+const char * msspi_get_alpn( MSSPI_HANDLE h )
+{
+    return NULL;
+}
+
+PSecPkgContext_CipherInfo msspi_get_cipherinfo( MSSPI_HANDLE h )
+{
+    if( h->step < 2 )
+        return NULL;
+
+    return &h->cipher;
+}
+
+int msspi_get_peercerts( MSSPI_HANDLE h, const char ** bufs, int * lens, size_t * count )
+{
+    if( h->step < 2 )
+        return 0;
+
+    if( bufs )
+    {
+        bufs[0] = h->peer.data();
+        lens[0] = (int)h->peer.size();
+    }
+
+    *count = 1;
+    return 1;
+}
+
+int msspi_get_issuerlist( MSSPI_HANDLE h, const char ** bufs, int * lens, size_t * count )
+{
+    return 0;
+}
+
+unsigned msspi_verify( MSSPI_HANDLE h )
+{
+    return MSSPI_VERIFY_OK;
+}
+
+// CSP
+//
+// certificates are their encoding, the "MY" store is |g_my_store|, walks of
+// it are counted, there are no keys
+
+struct TEST_CERT
+{
+    CERT_CONTEXT ctx;
+    CERT_INFO info;
+    std::string der;
+    size_t index;
+};
+
+static std::atomic<int> g_certs( 0 );
+static std::vector<std::string> g_my_store;
+static int g_my_store_walks = 0;
+
+static PCCERT_CONTEXT test_cert_new( const BYTE * der, DWORD len )
+{
+    TEST_CERT * c = new TEST_CERT();
+
+    c->der.assign( (const char *)der, len );
+    c->info.SignatureAlgorithm.pszObjId = (LPSTR)szOID_CP_GOST_R3411_12_256_R3410;
+    c->info.NotAfter.dwHighDateTime = 0x7FFFFFFF;
+    c->ctx.dwCertEncodingType = X509_ASN_ENCODING;
+    c->ctx.pbCertEncoded = (BYTE *)&c->der[0];
+    c->ctx.cbCertEncoded = len;
+    c->ctx.pCertInfo = &c->info;
+
+    g_certs++;
+
+    return &c->ctx;
+}
+
+BOOL WINAPI CryptAcquireContext( HCRYPTPROV * phProv, LPCSTR szContainer, LPCSTR szProvider, DWORD dwProvType, DWORD dwFlags )
+{
+    *phProv = 1;
+    return TRUE;
+}
+
+BOOL WINAPI CryptReleaseContext( HCRYPTPROV hProv, DWORD dwFlags )
+{
+    return TRUE;
+}
+
+PCCERT_CONTEXT WINAPI CertCreateCertificateContext( DWORD dwCertEncodingType, const BYTE * pbCertEncoded, DWORD cbCertEncoded )
+{
+    return test_cert_new( pbCertEncoded, cbCertEncoded );
+}
+
+PCCERT_CONTEXT WINAPI CertDuplicateCertificateContext( PCCERT_CONTEXT pCertContext )
+{
+    return test_cert_new( pCertContext->pbCertEncoded, pCertContext->cbCertEncoded );
+}
+
+BOOL WINAPI CertFreeCertificateContext( PCCERT_CONTEXT pCertContext )
+{
+    if( pCertContext )
+    {
+        g_certs--;
+        delete (TEST_CERT *)pCertContext;
+    }
+
+    return TRUE;
+}
+
+HCERTSTORE WINAPI CertOpenStore( LPCSTR lpszStoreProvider, DWORD dwEncodingType, HCRYPTPROV hCryptProv, DWORD dwFlags, const void * pvPara )
+{
+    return pvPara && !strcmp( (const char *)pvPara, "MY" ) ? (HCERTSTORE)&g_my_store : NULL;
+}
+
+BOOL WINAPI CertCloseStore( HCERTSTORE hCertStore, DWORD dwFlags )
+{
+    return TRUE;
+}
+
+BOOL WINAPI CertControlStore( HCERTSTORE hCertStore, DWORD dwFlags, DWORD dwCtrlType, const void * pvCtrlPara )
+{
+    return FALSE;
+}
+
+// the previous certificate is freed, as the CSP does
+PCCERT_CONTEXT WINAPI CertFindCertificateInStore( HCERTSTORE hCertStore, DWORD dwCertEncodingType, DWORD dwFindFlags, DWORD dwFindType, const void * pvFindPara, PCCERT_CONTEXT pPrevCertContext )
+{
+    size_t index = 0;
+
+    if( pPrevCertContext )
+    {
+        index = ( (const TEST_CERT *)pPrevCertContext )->index + 1;
+        CertFreeCertificateContext( pPrevCertContext );
+    }
+    else
+        g_my_store_walks++;
+
+    if( hCertStore != (HCERTSTORE)&g_my_store || index >= g_my_store.size() )
+        return NULL;
+
+    PCCERT_CONTEXT pcert = test_cert_new( (const BYTE *)g_my_store[index].data(), (DWORD)g_my_store[index].size() );
+    ( (TEST_CERT *)pcert )->index = index;
+
+    return pcert;
+}
+
+BOOL WINAPI CertGetIntendedKeyUsage( DWORD dwCertEncodingType, PCERT_INFO pCertInfo, BYTE * pbKeyUsage, DWORD cbKeyUsage )
+{
+    *pbKeyUsage = CERT_DIGITAL_SIGNATURE_KEY_USAGE;
+    return TRUE;
+}
+
+BOOL WINAPI CertGetCertificateContextProperty( PCCERT_CONTEXT pCertContext, DWORD dwPropId, void * pvData, DWORD * pcbData )
+{
+    return dwPropId == CERT_KEY_PROV_INFO_PROP_ID;
+}
+
+// checks
+
+static int failed = 0;
+
+static void check( const char * name, bool is_ok )
+{
+    printf( "%-32s %s\n", name, is_ok ? "ok" : "FAILED" );
+
+    if( !is_ok )
+        failed++;
+}
+
+// waits up to a second for |done|
+template< typename F >
+static bool test_wait( F done )
+{
+    for( int i = 0; i < 1000 && !done(); i++ )
+        std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+
+    return done();
+}
+
+// a connection to |hostname| known to speak GOST
+static SSL * test_gost_ssl( const char * hostname )
+{
+    std::string site = hostname;
+    site += ":test";
+
+    HOST_STATE st = { GOSTSSL_HOST_YES, 0, 0, 0, 0 };
+    host_status_load( site, st );
+
+    SSL * s = test_ssl_new( hostname );
+    gostssl_cachestring( s, "test", NULL );
+
+    return s;
+}
+
+static MSSPI_HANDLE test_msspi( SSL * s )
+{
+    GostSSL_Worker * w = workers_api( s, WDB_SEARCH );
+
+    return w ? w->h : NULL;
+}
+
+// calls gostssl_connect() until it is done or waits for more than the BIO,
+// returns its result
+static int test_connect( SSL * s )
+{
+    int is_gost;
+    int ret;
+
+    for( int i = 0; i < 1000; i++ )
+    {
+        ret = gostssl_connect( s, &is_gost );
+
+        if( ret != -1 || s->rwstate != SSL_READING || test_bio( s )->is_held )
+            break;
+
+        std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+    }
+
+    return ret;
+}
+
+// worker binding
+//
+// threads bind, look up and free interleaved connections, every lookup
+// must find the worker of its own SSL, workers are reused from the pool
+
+static void workers_thread( int id, std::atomic<int> * errors )
+{
+    SSL * s[8];
+    char host[64];
+
+    for( int round = 0; round < 200; round++ )
+    {
+        for( int i = 0; i < 8; i++ )
+        {
+            snprintf( host, sizeof( host ), "w%d-%d.test", id, i );
+            s[i] = test_ssl_new( host );
+            gostssl_cachestring( s[i], "test", NULL );
+        }
+
+        for( int i = 0; i < 8; i++ )
+        {
+            GostSSL_Worker * w = workers_api( s[i], WDB_SEARCH );
+
+            snprintf( host, sizeof( host ), "w%d-%d.test:test", id, i );
+
+            if( !w || w->s != s[i] || w->host_string != host || !( (TEST_SSL *)s[i] )->mark )
+                (*errors)++;
+        }
+
+        for( int i = 0; i < 8; i++ )
+        {
+            SSL * f = s[( i * 5 + round ) % 8];
+
+            gostssl_free( f );
+
+            if( workers_api( f, WDB_SEARCH ) )
+                (*errors)++;
+
+            test_ssl_free( f );
+        }
+    }
+}
+
+static void test_workers()
+{
+    std::atomic<int> errors( 0 );
+    unsigned long long reused = g_counters[GOSTSSL_COUNTER_workers_reused].load();
+    std::vector<std::thread> threads;
+
+    for( int i = 0; i < 8; i++ )
+        threads.push_back( std::thread( workers_thread, i, &errors ) );
+
+    for( size_t i = 0; i < threads.size(); i++ )
+        threads[i].join();
+
+    check( "workers bound under threads", errors == 0 );
+    check( "workers reused", g_counters[GOSTSSL_COUNTER_workers_reused].load() > reused );
+}
+
+// lookups of 16 live connections per thread
+static void lookups_thread( uint64_t count, std::atomic<uint64_t> * sink )
+{
+    SSL * s[16];
+    uint64_t found = 0;
+
+    for( int i = 0; i < 16; i++ )
+    {
+        s[i] = test_ssl_new( "lookup.test" );
+        gostssl_cachestring( s[i], "test", NULL );
+    }
+
+    for( uint64_t i = 0; i < count; i++ )
+        found += workers_api( s[i & 15], WDB_SEARCH ) != NULL;
+
+    for( int i = 0; i < 16; i++ )
+        test_ssl_free( s[i] );
+
+    *sink += found;
+}
+
+static void bench_lookups()
+{
+    const uint64_t count = 1 << 22;
+    unsigned cores = std::thread::hardware_concurrency();
+
+    if( !cores )
+        cores = 1;
+
+    for( unsigned n = 1; n <= 64; n *= 4 )
+    {
+        std::atomic<uint64_t> sink( 0 );
+        std::vector<std::thread> threads;
+
+        auto start = std::chrono::steady_clock::now();
+
+        for( unsigned i = 0; i < n; i++ )
+            threads.push_back( std::thread( lookups_thread, count, &sink ) );
+
+        for( size_t i = 0; i < threads.size(); i++ )
+            threads[i].join();
+
+        double ns = std::chrono::duration<double, std::nano>( std::chrono::steady_clock::now() - start ).count();
+
+        // per core, threads beyond the cores only take turns
+        printf( "%-32s %.2f ns\n", ( "lookup, " + std::to_string( n ) + ( n == 1 ? " thread" : " threads" ) ).c_str(),
+            ns * ( n < cores ? n : cores ) / ( count * n ) );
+    }
+}
+
+// allocations per connection: |rounds| connections to |hostname| are
+// bound and freed, with a GOST handshake in between when |is_gost|, after
+// one that warms the pool and the host table
+
+static double bench_allocs( const char * hostname, bool is_gost, unsigned pool, int rounds )
+{
+    unsigned saved = g_worker_pool;
+    std::vector<GostSSL_Worker *> & free_workers = g_workers_pool.free;
+    bool is_ok = true;
+
+    g_worker_pool = pool;
+
+    for( size_t i = 0; i < free_workers.size(); i++ )
+        delete free_workers[i];
+
+    free_workers.clear();
+
+    if( is_gost )
+    {
+        HOST_STATE st = { GOSTSSL_HOST_YES, 0, 0, 0, 0 };
+        host_status_load( std::string( hostname ) + ":test", st );
+    }
+
+    uint64_t allocs = g_allocs;
+
+    for( int i = 0; is_ok && i <= rounds; i++ )
+    {
+        SSL * s = test_ssl_new( hostname );
+
+        if( i == 1 )
+            allocs = g_allocs;
+
+        g_alloc_counting = true;
+        gostssl_cachestring( s, "test", NULL );
+        is_ok = !is_gost || test_connect( s ) == 1;
+        gostssl_free( s );
+        g_alloc_counting = false;
+
+        test_ssl_free( s );
+    }
+
+    g_worker_pool = saved;
+
+    return is_ok ? (double)( g_allocs - allocs ) / rounds : -1;
+}
+
+static void bench_allocs()
+{
+    double auto_pooled = bench_allocs( "allocs-auto.test", false, GOSTSSL_WORKER_POOL, 1000 );
+    double auto_unpooled = bench_allocs( "allocs-auto.test", false, 0, 1000 );
+    double gost_pooled = bench_allocs( "allocs-gost.test", true, GOSTSSL_WORKER_POOL, 200 );
+    double gost_unpooled = bench_allocs( "allocs-gost.test", true, 0, 200 );
+
+    printf( "%-32s %.2f pooled, %.2f unpooled\n", "allocations, AUTO host", auto_pooled, auto_unpooled );
+    printf( "%-32s %.2f pooled, %.2f unpooled\n", "allocations, GOST handshake", gost_pooled, gost_unpooled );
+
+    check( "pooled churn allocates nothing", auto_pooled == 0 && auto_unpooled > 0 );
+    check( "pool saves handshake allocations", gost_pooled >= 0 && gost_pooled < gost_unpooled );
+}
+
+// client certificates
+//
+// concurrent handshakes are asked for a client certificate, each binds
+// its own, each msspi handle must end up with its own
+
+static int test_cert_cb( SSL * s, void * arg )
+{
+    const std::string * cert = (const std::string *)arg;
+
+    // let the other handshakes run in between
+    std::this_thread::yield();
+    gostssl_certbind( s, (void *)cert->data(), (int)cert->size() );
+    std::this_thread::yield();
+
+    return 1;
+}
+
+static void certs_thread( int id, std::atomic<int> * errors )
+{
+    char host[64];
+
+    for( int i = 0; i < 50; i++ )
+    {
+        snprintf( host, sizeof( host ), "c%d-%d.test", id, i );
+
+        std::string cert = host;
+        SSL * s = test_gost_ssl( host );
+
+        s->cert->cert_cb = test_cert_cb;
+        s->cert->cert_cb_arg = &cert;
+
+        if( test_connect( s ) != 1 || !test_msspi( s ) || test_msspi( s )->mycert != cert )
+            (*errors)++;
+
+        test_ssl_free( s );
+    }
+}
+
+static void test_certs()
+{
+    std::atomic<int> errors( 0 );
+    std::vector<std::thread> threads;
+
+    g_msspi_cert_requested = true;
+
+    for( int i = 0; i < 8; i++ )
+        threads.push_back( std::thread( certs_thread, i, &errors ) );
+
+    for( size_t i = 0; i < threads.size(); i++ )
+        threads[i].join();
+
+    g_msspi_cert_requested = false;
+
+    check( "client certs per connection", errors == 0 );
+    check( "client certs released", g_certs == 0 );
+}
+
+// the store is walked only when its file changes or Chromium's
+// certificate database does
+
+static int test_store_list()
+{
+    char ** certs;
+    int * lens;
+    int count;
+    int is_gost;
+
+    gostssl_clientcertshook( &certs, &lens, &count, &is_gost );
+
+    return count;
+}
+
+static void test_store_file( const char * content )
+{
+    FILE * f = fopen( getenv( "GOSTSSL_CERT_STORE" ), "w" );
+
+    if( f )
+    {
+        fputs( content, f );
+        fclose( f );
+    }
+}
+
+static void test_cert_store()
+{
+    g_my_store.clear();
+    g_my_store.push_back( "store-1" );
+    test_store_file( "1" );
+    gostssl_keys_flush( NULL, 0 );
+
+    int walks = g_my_store_walks;
+    bool is_listed = test_store_list() == 1;
+
+    for( int i = 0; i < 100; i++ )
+        is_listed = is_listed && test_store_list() == 1;
+
+    check( "client certs walk once", is_listed && g_my_store_walks == walks + 1 );
+
+    g_my_store.push_back( "store-2" );
+    test_store_file( "12" );
+
+    check( "client certs store file", test_store_list() == 2 && g_my_store_walks == walks + 2 );
+
+    g_my_store.pop_back();
+    gostssl_keys_flush( NULL, 0 );
+
+    check( "client certs cert db changed", test_store_list() == 1 && g_my_store_walks == walks + 3 );
+
+    g_my_store.clear();
+    gostssl_keys_flush( NULL, 0 );
+    test_store_list();
+}
+
+// preload
+//
+// operator entries from GOSTSSL_PRELOAD, a suffix covers subdomains
+
+static void test_preload()
+{
+    check( "preload host", host_status_get( "gost.preload.test:test" ) == GOSTSSL_HOST_YES );
+    check( "preload suffix", host_status_get( "a.b.suffix.test:test" ) == GOSTSSL_HOST_YES );
+    check( "preload exact only", host_status_get( "a.gost.preload.test:test" ) == GOSTSSL_HOST_AUTO );
+}
+
+// host inference
+//
+// a completed handshake teaches its registrable domain, other hosts of
+// it start with GOST, tenants of a private registry share nothing
+
+static void test_inference()
+{
+    host_status_propagate( "www.bank.test:test", "bank.test" );
+    host_status_propagate( "a.pages.test:test", "a.pages.test" );
+    host_status_propagate( "www.shop.test:test", "" );
+
+    std::string inferred;
+
+    check( "inferred from the domain",
+        host_status_get( "online.bank.test:test", "bank.test", &inferred ) == GOSTSSL_HOST_YES && inferred == ".bank.test" );
+    check( "inferred from the hostname", host_status_get( "www.shop.test:other", "" ) == GOSTSSL_HOST_YES );
+    check( "tenants share nothing", host_status_get( "b.pages.test:test", "b.pages.test" ) == GOSTSSL_HOST_AUTO );
+    check( "no domain, no inference", host_status_get( "online.shop.test:test", "" ) == GOSTSSL_HOST_AUTO );
+    check( "foreign domain ignored", host_status_get( "www.other.test:test", "bank.test" ) == GOSTSSL_HOST_AUTO );
+}
+
+// handshake offload
+//
+// a wake callback moves msspi_connect() to the pool, the network thread
+// only moves flights between the BIO and the worker
+
+struct TEST_LOOP
+{
+    TEST_LOOP()
+    {
+        wakes = 0;
+        finals = 0;
+    }
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    unsigned wakes;
+    unsigned finals;
+};
+
+static void test_wake( void * arg, int is_final )
+{
+    TEST_LOOP * loop = (TEST_LOOP *)arg;
+
+    {
+        std::unique_lock<std::mutex> lck( loop->mutex );
+
+        if( is_final )
+            loop->finals++;
+        else
+            loop->wakes++;
+    }
+
+    loop->cv.notify_all();
+}
+
+static unsigned test_wakes( TEST_LOOP * loop, bool is_final )
+{
+    std::unique_lock<std::mutex> lck( loop->mutex );
+
+    return is_final ? loop->finals : loop->wakes;
+}
+
+// one network thread drives |conns| until every handshake is over,
+// waiting for wakes in between, |stall_us| is the time spent in gostssl
+static bool test_handshakes( std::vector<SSL *> & conns, TEST_LOOP * loop, uint64_t & stall_us )
+{
+    std::vector<bool> done( conns.size(), false );
+    size_t left = conns.size();
+    bool is_ok = true;
+
+    stall_us = 0;
+
+    for( int i = 0; left && i < 10000; i++ )
+    {
+        unsigned wakes = test_wakes( loop, false );
+
+        for( size_t j = 0; j < conns.size(); j++ )
+        {
+            if( done[j] )
+                continue;
+
+            int is_gost;
+            uint64_t start = gostssl_time_us();
+            int ret = gostssl_connect( conns[j], &is_gost );
+            stall_us += gostssl_time_us() - start;
+
+            if( ret == -1 && conns[j]->rwstate == SSL_READING )
+                continue;
+
+            if( ret != 1 )
+                is_ok = false;
+
+            done[j] = true;
+            left--;
+        }
+
+        if( left )
+        {
+            std::unique_lock<std::mutex> lck( loop->mutex );
+            loop->cv.wait_for( lck, std::chrono::milliseconds( 1 ), [&]{ return loop->wakes != wakes; } );
+        }
+    }
+
+    return is_ok && !left;
+}
+
+static void test_offload()
+{
+    TEST_LOOP loop;
+    uint64_t stall_us;
+
+    // wake path
+    {
+        SSL * s = test_gost_ssl( "offload.test" );
+        std::vector<SSL *> conns( 1, s );
+
+        gostssl_handshake_wake( s, test_wake, &loop );
+
+        int is_gost;
+        int ret = gostssl_connect( s, &is_gost );
+
+        check( "offload wants read", ret == -1 && s->rwstate == SSL_READING );
+        check( "offload handshake", test_handshakes( conns, &loop, stall_us ) );
+        check( "offload wakes", test_wakes( &loop, false ) >= 2 );
+        check( "offload flights in order", test_bio( s )->out == "client-hello;client-finished;" );
+        check( "offload BIO on network thread", !test_bio( s )->is_foreign_write );
+
+        test_ssl_free( s );
+        check( "offload final wake", test_wakes( &loop, true ) == 1 );
+    }
+
+    // the client certificate is still chosen on the network thread
+    {
+        std::string cert = "offload-cert";
+        SSL * s = test_gost_ssl( "offload-cert.test" );
+        std::vector<SSL *> conns( 1, s );
+
+        s->cert->cert_cb = test_cert_cb;
+        s->cert->cert_cb_arg = &cert;
+
+        g_msspi_cert_requested = true;
+        gostssl_handshake_wake( s, test_wake, &loop );
+        bool is_ok = test_handshakes( conns, &loop, stall_us );
+        g_msspi_cert_requested = false;
+
+        check( "offload client cert", is_ok && test_msspi( s ) && test_msspi( s )->mycert == cert );
+
+        test_ssl_free( s );
+    }
+
+    // freed while a job runs, the pool thread releases the worker
+    {
+        TEST_LOOP orphan;
+        int handles = g_msspi_handles;
+
+        SSL * s = test_gost_ssl( "orphan.test" );
+
+        gostssl_handshake_wake( s, test_wake, &orphan );
+
+        int is_gost;
+        g_msspi_cost_us = 50000;
+        gostssl_connect( s, &is_gost );
+        g_msspi_cost_us = 0;
+        test_ssl_free( s );
+
+        check( "orphan final wake", test_wait( [&]{ return test_wakes( &orphan, true ) == 1; } ) );
+        check( "orphan no wake", test_wakes( &orphan, false ) == 0 );
+        check( "orphan msspi closed", test_wait( [&]{ return g_msspi_handles == handles; } ) );
+    }
+}
+
+// N connects on one network thread, each handshake step costs 2 ms,
+// returns how long the network thread was stalled
+static uint64_t bench_offload( const char * name, bool is_offloaded )
+{
+    const size_t count = 8;
+    TEST_LOOP loop;
+    std::vector<SSL *> conns;
+    char host[64];
+
+    g_msspi_cost_us = 2000;
+    g_false_start = false;
+
+    for( size_t i = 0; i < count; i++ )
+    {
+        snprintf( host, sizeof( host ), "bench-%d-%d.test", (int)is_offloaded, (int)i );
+        conns.push_back( test_gost_ssl( host ) );
+
+        if( is_offloaded )
+            gostssl_handshake_wake( conns[i], test_wake, &loop );
+    }
+
+    uint64_t stall_us;
+    uint64_t start = gostssl_time_us();
+    bool is_ok = test_handshakes( conns, &loop, stall_us );
+    double s = ( gostssl_time_us() - start ) / 1e6;
+
+    g_msspi_cost_us = 0;
+    g_false_start = true;
+
+    for( size_t i = 0; i < count; i++ )
+        test_ssl_free( conns[i] );
+
+    check( name, is_ok );
+    printf( "%-32s %.0f handshakes/s, stalled %.1f ms\n", name, count / s, stall_us / 1e3 );
+
+    return stall_us;
+}
+
+// |count| established connections, tabs being closed, are freed at once
+// halfway through a transfer on the same network thread, closing a
+// handle costs 2 ms, returns the longest gap between two writes
+static uint64_t bench_close( const char * name, bool is_reclaimed )
+{
+    const size_t count = 16;
+    static char buf[GOSTSSL_RECORD_MAX];
+    std::vector<SSL *> tabs;
+    char host[64];
+    int handles = g_msspi_handles;
+    int is_gost;
+    bool is_ok = true;
+
+    g_reclaim = is_reclaimed;
+
+    for( size_t i = 0; i < count; i++ )
+    {
+        snprintf( host, sizeof( host ), "close-%d-%d.test", (int)is_reclaimed, (int)i );
+        tabs.push_back( test_gost_ssl( host ) );
+        is_ok = is_ok && test_connect( tabs[i] ) == 1;
+    }
+
+    snprintf( host, sizeof( host ), "close-%d-live.test", (int)is_reclaimed );
+    SSL * live = test_gost_ssl( host );
+    is_ok = is_ok && test_connect( live ) == 1;
+    test_bio( live )->is_sink = true;
+
+    g_msspi_close_us = 2000;
+
+    uint64_t gap_us = 0;
+    uint64_t last = gostssl_time_us();
+
+    for( int i = 0; is_ok && i < 64; i++ )
+    {
+        if( i == 32 )
+        {
+            for( size_t j = 0; j < tabs.size(); j++ )
+                test_ssl_free( tabs[j] );
+
+            tabs.clear();
+        }
+
+        is_ok = gostssl_write( live, buf, sizeof( buf ), &is_gost ) == (int)sizeof( buf );
+
+        uint64_t now = gostssl_time_us();
+
+        if( now - last > gap_us )
+            gap_us = now - last;
+
+        last = now;
+    }
+
+    for( size_t j = 0; j < tabs.size(); j++ )
+        test_ssl_free( tabs[j] );
+
+    test_ssl_free( live );
+
+    is_ok = is_ok && test_wait( [&]{ return g_msspi_handles <= handles; } );
+
+    g_msspi_close_us = 0;
+    g_reclaim = true;
+
+    check( name, is_ok );
+    printf( "%-32s longest write gap %.1f ms\n", name, gap_us / 1e3 );
+
+    return gap_us;
+}
+
+// false start
+//
+// the handshake is reported done once the client's Finished is out, a
+// record written meanwhile is held back until the server's Finished
+
+static unsigned test_host_fails( const std::string & site )
+{
+    std::unique_lock<std::mutex> lck( g_hosts_mutex );
+
+    HOST_TABLE * t = g_hosts.load();
+    HOST_ENTRY * e = t ? host_table_find( t, site, host_hash( site.data(), site.size() ) ) : NULL;
+
+    return e ? e->fails : 0xFF;
+}
+
+// what the client wrote after its handshake
+static std::string test_app_data( SSL * s )
+{
+    const std::string & out = test_bio( s )->out;
+    const char * finished = g_flights[TEST_FLIGHTS - 1][0];
+    size_t pos = out.find( finished );
+
+    return pos == std::string::npos ? std::string() : out.substr( pos + strlen( finished ) );
+}
+
+// a connection reported done while the server's Finished is held back
+static SSL * test_false_start( const char * hostname )
+{
+    SSL * s = test_gost_ssl( hostname );
+
+    test_bio( s )->is_held = true;
+    test_connect( s );
+    test_bio_deliver( test_bio( s ) );
+
+    if( test_connect( s ) != 1 )
+        return NULL;
+
+    return s;
+}
+
+static void test_false_start()
+{
+    int is_gost;
+    char buf[256];
+
+    // queued, then sent once the handshake completes
+    {
+        SSL * s = test_false_start( "fs.test" );
+        GostSSL_Worker * w = s ? workers_api( s, WDB_SEARCH ) : NULL;
+
+        check( "false start reported done", w && w->is_false_start && s->s3->established_session && s->version == TLS1_2_VERSION );
+
+        if( !w )
+            return;
+
+        std::vector<char> big( 20000, 'x' );
+        int r1 = gostssl_write( s, "GET /", 5, &is_gost );
+        int r2 = gostssl_write( s, &big[0], (int)big.size(), &is_gost );
+        int r3 = gostssl_write( s, &big[0], (int)big.size(), &is_gost );
+
+        check( "false start queues a record", r1 == 5 && r2 == GOSTSSL_RECORD_MAX - 5 && r3 == -1 && s->rwstate == SSL_READING );
+        check( "false start holds data", test_app_data( s ).empty() );
+
+        test_bio_deliver( test_bio( s ) );
+
+        int r4 = gostssl_read( s, buf, sizeof( buf ), &is_gost );
+        std::string data = test_app_data( s );
+
+        check( "false start sends data", r4 == -1 && s->rwstate == SSL_READING &&
+            data.size() == GOSTSSL_RECORD_MAX && data.compare( 0, 5, "GET /" ) == 0 );
+        check( "false start completes", !w->is_false_start && w->is_handshake_done &&
+            host_status_get( "fs.test:test" ) == GOSTSSL_HOST_YES );
+
+        test_ssl_free( s );
+    }
+
+    // the server's Finished comes with another chain
+    {
+        SSL * s = test_false_start( "fs-changed.test" );
+
+        if( s )
+        {
+            test_msspi( s )->peer = "peer-2";
+            test_bio_deliver( test_bio( s ) );
+
+            int ret = gostssl_write( s, "GET /", 5, &is_gost );
+
+            check( "false start chain changed", ret == -1 && s->rwstate == SSL_NOTHING &&
+                g_ssl_error == SSL_R_SERVER_CERT_CHANGED && test_app_data( s ).empty() );
+
+            test_ssl_free( s );
+        }
+        else
+            check( "false start chain changed", false );
+    }
+
+    // closed early, unlike an abandoned handshake, it is no failure
+    {
+        SSL * s = test_false_start( "fs-closed.test" );
+
+        if( s )
+            test_ssl_free( s );
+
+        s = test_gost_ssl( "fs-aborted.test" );
+        test_bio( s )->is_held = true;
+        test_connect( s );
+        test_ssl_free( s );
+
+        check( "false start closed", test_host_fails( "fs-closed.test:test" ) == 0 );
+        check( "handshake aborted", test_host_fails( "fs-aborted.test:test" ) == 1 );
+    }
+}
+
+// until the request is on the wire, the caller verifies the chain for
+// |verify_ms| once the handshake is reported done; the request waits for
+// the server's Finished either way, false start only overlaps the
+// verification with that round trip, the figure is the scripted server's
+// and a sleep standing in for the verifier, not a network's
+static double bench_ttfb( const char * hostname, unsigned rtt_ms, unsigned verify_ms )
+{
+    SSL * s = test_gost_ssl( hostname );
+    int is_gost;
+    char buf[16];
+
+    test_bio( s )->rtt_ms = rtt_ms;
+
+    uint64_t start = gostssl_time_us();
+    bool is_ok = test_connect( s ) == 1;
+
+    std::this_thread::sleep_for( std::chrono::milliseconds( verify_ms ) );
+
+    is_ok = is_ok && gostssl_write( s, "GET /", 5, &is_gost ) == 5;
+
+    for( int i = 0; is_ok && i < 1000 && test_app_data( s ).empty(); i++ )
+    {
+        gostssl_read( s, buf, sizeof( buf ), &is_gost );
+        std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+    }
+
+    double ms = ( gostssl_time_us() - start ) / 1e3;
+
+    is_ok = is_ok && !test_app_data( s ).empty();
+    test_ssl_free( s );
+
+    return is_ok ? ms : -1;
+}
+
+// handshake latency
+//
+// |rounds| handshakes at |rtt_ms|, the mean time until gostssl_connect()
+// returns 1: a full TLS 1.2 handshake waits two round trips, a false
+// start and TLS 1.3 one
+
+static double bench_handshake( const char * hostname, bool is_tls13, unsigned rtt_ms, int rounds )
+{
+    GOSTSSL_COUNTER id = is_tls13 ? GOSTSSL_COUNTER_handshakes_tls13 : GOSTSSL_COUNTER_handshakes_tls12;
+    unsigned long long counted = g_counters[id].load();
+    uint16_t version = is_tls13 ? TLS1_3_DRAFT_VERSION : TLS1_2_VERSION;
+    uint64_t total_us = 0;
+    bool is_ok = true;
+
+    g_msspi_tls13 = is_tls13;
+
+    for( int i = 0; is_ok && i < rounds; i++ )
+    {
+        SSL * s = test_gost_ssl( hostname );
+
+        test_bio( s )->rtt_ms = rtt_ms;
+        test_bio( s )->is_tls13 = is_tls13;
+
+        uint64_t start = gostssl_time_us();
+        is_ok = test_connect( s ) == 1 && s->version == version;
+        total_us += gostssl_time_us() - start;
+
+        test_ssl_free( s );
+    }
+
+    g_msspi_tls13 = false;
+
+    is_ok = is_ok && g_counters[id].load() - counted == (unsigned long long)rounds;
+
+    return is_ok ? total_us / 1e3 / rounds : -1;
+}
+
+// bulk transfer
+//
+// an established connection moves data in |chunk| sized calls, the
+// stubbed msspi does no cryptography, so the figures are what gostssl
+// and its copies cost around the CSP, not what a suite costs in it
+
+static SSL * test_established( const char * hostname )
+{
+    SSL * s = test_gost_ssl( hostname );
+
+    if( test_connect( s ) != 1 )
+    {
+        test_ssl_free( s );
+        return NULL;
+    }
+
+    test_bio( s )->is_sink = true;
+
+    return s;
+}
+
+static bool test_write_bulk( SSL * s, uint64_t bytes, int chunk )
+{
+    static char buf[64 * 1024];
+    int is_gost;
+
+    for( uint64_t done = 0; done < bytes; )
+    {
+        int len = bytes - done < (uint64_t)chunk ? (int)( bytes - done ) : chunk;
+        int ret = gostssl_write( s, buf, len, &is_gost );
+
+        if( ret <= 0 )
+            return false;
+
+        done += ret;
+    }
+
+    return true;
+}
+
+// the server sends |bytes| in whole records
+static bool test_read_bulk( SSL * s, uint64_t bytes, int chunk )
+{
+    static char buf[64 * 1024];
+    int is_gost;
+    uint64_t records = ( bytes + GOSTSSL_RECORD_MAX - 1 ) / GOSTSSL_RECORD_MAX;
+
+    test_bio( s )->stream += records * test_record_size( (uint16_t)test_msspi( s )->cipher.dwCipherSuite );
+
+    for( uint64_t done = 0; done < bytes; )
+    {
+        int len = bytes - done < (uint64_t)chunk ? (int)( bytes - done ) : chunk;
+        int ret = gostssl_read( s, buf, len, &is_gost );
+
+        if( ret <= 0 )
+            return false;
+
+        done += ret;
+    }
+
+    return true;
+}
+
+static unsigned long long test_counter( GOSTSSL_COUNTER id )
+{
+    return g_counters[id].load();
+}
+
+// a write goes out in as few records as fit it
+static void test_write_records()
+{
+    SSL * s = test_established( "records.test" );
+    std::string request( 4096, 'r' );
+    std::string body( 2 * GOSTSSL_RECORD_MAX + 100, 'b' );
+    int is_gost;
+
+    check( "records connect", s != NULL );
+
+    if( !s )
+        return;
+
+    unsigned long long records = test_counter( GOSTSSL_COUNTER_write_records );
+    int ret = gostssl_write( s, request.data(), (int)request.size(), &is_gost );
+
+    check( "4 KB request is one record", ret == (int)request.size() && test_counter( GOSTSSL_COUNTER_write_records ) - records == 1 );
+
+    records = test_counter( GOSTSSL_COUNTER_write_records );
+    unsigned long long small = test_counter( GOSTSSL_COUNTER_write_small_records );
+    ret = gostssl_write( s, body.data(), (int)body.size(), &is_gost );
+
+    check( "bulk write in full records", ret == (int)body.size() &&
+        test_counter( GOSTSSL_COUNTER_write_records ) - records == 3 && test_counter( GOSTSSL_COUNTER_write_small_records ) - small == 1 );
+
+    test_ssl_free( s );
+}
+
+// read path
+//
+// records are read in |chunk| sized calls with msspi reading whole
+// buffers or piece by piece and the ciphertext read-ahead on or off,
+// copies are counted per plaintext byte: gostssl's own (ciphertext
+// through the read-ahead buffer, plaintext through the worker) and all
+// of them (the BIO's, msspi's copy out and moves of partial records)
+
+// gostssl's copies per byte, -1 on failure
+static double bench_read( bool is_piecewise, unsigned read_ahead, int chunk )
+{
+    const uint64_t bytes = 64 * 1024 * 1024;
+    const uint64_t records = bytes / GOSTSSL_RECORD_MAX;
+
+    g_msspi_piecewise = is_piecewise;
+    g_read_ahead = read_ahead;
+
+    SSL * s = test_established( "read.test" );
+
+    uint64_t bio = g_bio_copied;
+    uint64_t copied = g_msspi_copied;
+    uint64_t moved = g_msspi_moved;
+    unsigned long long reads = test_counter( GOSTSSL_COUNTER_io_bio_reads );
+    unsigned long long buffered = test_counter( GOSTSSL_COUNTER_io_buffered_bytes );
+    unsigned long long plain = test_counter( GOSTSSL_COUNTER_io_plain_buffered_bytes );
+
+    uint64_t start = gostssl_time_us();
+    bool is_ok = s && test_read_bulk( s, bytes, chunk );
+    uint64_t us = gostssl_time_us() - start;
+
+    double own = (double)( test_counter( GOSTSSL_COUNTER_io_buffered_bytes ) - buffered +
+        test_counter( GOSTSSL_COUNTER_io_plain_buffered_bytes ) - plain ) / bytes;
+    double all = own + (double)( g_bio_copied - bio + g_msspi_copied - copied + g_msspi_moved - moved ) / bytes;
+    double per_record = (double)( test_counter( GOSTSSL_COUNTER_io_bio_reads ) - reads ) / records;
+
+    if( s )
+        test_ssl_free( s );
+
+    g_msspi_piecewise = false;
+    g_read_ahead = GOSTSSL_READ_AHEAD;
+
+    char name[64];
+
+    snprintf( name, sizeof( name ), "read %s%s, %d", is_piecewise ? "piecewise" : "whole", read_ahead ? "+ahead" : "", chunk );
+    printf( "%-32s %.0f MB/s, copies/byte %.2f own %.2f all, BIO reads/record %.2f\n",
+        name, is_ok && us ? bytes / (double)us : 0, own, all, per_record );
+
+    return is_ok ? own : -1;
+}
+
+static void bench_reads()
+{
+    double own = bench_read( false, GOSTSSL_READ_AHEAD, GOSTSSL_RECORD_MAX );
+
+    check( "whole records read uncopied", own == 0 );
+
+    bool is_ok =
+        bench_read( false, GOSTSSL_READ_AHEAD, 4096 ) >= 0 &&
+        bench_read( true, 0, GOSTSSL_RECORD_MAX ) >= 0 &&
+        bench_read( true, GOSTSSL_READ_AHEAD, GOSTSSL_RECORD_MAX ) >= 0 &&
+        bench_read( true, GOSTSSL_READ_AHEAD, 4096 ) >= 0;
+
+    check( "read path", is_ok );
+}
+
+// suites
+//
+// each suite moves 64 MB each way, its bytes must be counted for it
+// alone; without the RFC 9189 suites gostssl_init() still succeeds and
+// the GOST 28147 ones still run, checked in a child since gostssl starts
+// once per process
+
+static bool test_old_suites()
+{
+    pid_t pid = fork();
+
+    if( pid == 0 )
+    {
+        const char * store = "gostssl_test_hosts_old";
+
+        unlink( store );
+        setenv( "GOSTSSL_STORE", store, 1 );
+        g_ciphers_old = true;
+
+        bool is_ok = gostssl_init( &g_bssl ) && csp_ready() &&
+            is_gost_cipher( g_ciphers[0] ) && is_gost_cipher( g_ciphers[1] ) &&
+            !is_gost_cipher( g_ciphers[2] ) && !is_gost_cipher( NULL );
+
+        SSL * s = is_ok ? test_established( "old.test" ) : NULL;
+
+        is_ok = s && s->version == TLS1_2_VERSION;
+
+        if( s )
+            test_ssl_free( s );
+
+        unlink( store );
+        _exit( is_ok ? 0 : 1 );
+    }
+
+    int status = 0;
+
+    return pid > 0 && waitpid( pid, &status, 0 ) == pid && WIFEXITED( status ) && WEXITSTATUS( status ) == 0;
+}
+
+static void bench_suites()
+{
+    static const char * names[4] = { "2001", "2012", "kuznyechik", "magma" };
+    static const GOSTSSL_COUNTER counters[4] =
+    {
+        GOSTSSL_COUNTER_suite_2001_bytes, GOSTSSL_COUNTER_suite_2012_bytes,
+        GOSTSSL_COUNTER_suite_kuznyechik_bytes, GOSTSSL_COUNTER_suite_magma_bytes,
+    };
+    const uint64_t bytes = 64 * 1024 * 1024;
+
+    for( size_t i = 0; i < 4; i++ )
+    {
+        char name[64];
+        unsigned long long before[4];
+
+        for( size_t j = 0; j < 4; j++ )
+            before[j] = test_counter( counters[j] );
+
+        snprintf( name, sizeof( name ), "suite-%s.test", names[i] );
+        g_msspi_suite = g_cipher_values[i];
+
+        SSL * s = test_established( name );
+        uint64_t start = gostssl_time_us();
+        bool is_ok = s && test_write_bulk( s, bytes, GOSTSSL_RECORD_MAX ) && test_read_bulk( s, bytes, GOSTSSL_RECORD_MAX );
+        uint64_t us = gostssl_time_us() - start;
+
+        for( size_t j = 0; j < 4; j++ )
+            is_ok = is_ok && test_counter( counters[j] ) - before[j] == ( i == j ? 2 * bytes : 0 );
+
+        if( s )
+            test_ssl_free( s );
+
+        snprintf( name, sizeof( name ), "suite %s", names[i] );
+        printf( "%-32s %.0f MB/s\n", name, is_ok && us ? 2 * bytes / (double)us : 0 );
+        snprintf( name, sizeof( name ), "suite %s counted", names[i] );
+        check( name, is_ok );
+    }
+
+    g_msspi_suite = TLS_GOST_CIPHER_2012;
+}
+
+// boringssl hooks
+//
+// SSL_read and SSL_write as boringssl.patch hooks them: gostssl is
+// resolved once through its function table and the marker is checked
+// before calling into it, boringssl's own record layer is stood in for
+// by a copy of the data
+
+static GOSTSSL_METHOD g_gssl;
+static bool g_gssl_loaded = false;
+static std::once_flag g_gssl_once;
+static char g_record[GOSTSSL_RECORD_MAX];
+
+static void test_gostssl_load()
+{
+    const GOSTSSL_API * api = gostssl_api( GOSTSSL_API_VERSION );
+
+    g_gssl.init = api->init;
+    g_gssl.connect = api->connect;
+    g_gssl.read = api->read;
+    g_gssl.write = api->write;
+    g_gssl.free = api->free;
+    g_gssl.tls_gost_required = api->tls_gost_required;
+    g_gssl.csp_state = api->csp_state;
+    g_gssl.peek = api->peek;
+    g_gssl.pending = api->pending;
+}
+
+// |g_gssl_loaded| unset is a chromium without gostssl.so
+GOSTSSL_METHOD * gostssl()
+{
+    std::call_once( g_gssl_once, test_gostssl_load );
+
+    return g_gssl_loaded ? &g_gssl : NULL;
+}
+
+static int test_SSL_read( SSL * ssl, void * buf, int num )
+{
+    if( gostssl() && ( (TEST_SSL *)ssl )->mark )
+    {
+        int is_gost;
+        int ret_gost = gostssl()->read( ssl, buf, num, &is_gost );
+
+        if( is_gost )
+            return ret_gost;
+    }
+
+    memcpy( buf, g_record, num );
+    return num;
+}
+
+static int test_SSL_write( SSL * ssl, const void * buf, int num )
+{
+    if( gostssl() && ( (TEST_SSL *)ssl )->mark )
+    {
+        int is_gost;
+        int ret_gost = gostssl()->write( ssl, buf, num, &is_gost );
+
+        if( is_gost )
+            return ret_gost;
+    }
+
+    memcpy( g_record, buf, num );
+    return num;
+}
+
+// an ordinary HTTPS connection, |chunk| bytes each way per round; with
+// |is_remarked| the marker is set again before every call, as if there
+// were none and each call went into gostssl to fall back
+static double bench_hook( const char * name, bool is_loaded, bool is_remarked, int chunk )
+{
+    const int rounds = 1 << 20;
+    static char buf[GOSTSSL_RECORD_MAX];
+    SSL * s = test_ssl_new( "hooks.test" );
+    bool is_ok = true;
+
+    g_gssl_loaded = is_loaded;
+
+    if( is_loaded )
+        gostssl_cachestring( s, "test", NULL );
+
+    uint64_t start = gostssl_time_us();
+
+    for( int i = 0; is_ok && i < rounds; i++ )
+    {
+        if( is_remarked )
+            ( (TEST_SSL *)s )->mark = 1;
+
+        is_ok = test_SSL_write( s, buf, chunk ) == chunk;
+
+        if( is_remarked )
+            ( (TEST_SSL *)s )->mark = 1;
+
+        is_ok = is_ok && test_SSL_read( s, buf, chunk ) == chunk;
+    }
+
+    double ns = ( gostssl_time_us() - start ) * 1e3 / ( 2.0 * rounds );
+
+    is_ok = is_ok && ( is_remarked || !( (TEST_SSL *)s )->mark );
+
+    g_gssl_loaded = false;
+    test_ssl_free( s );
+
+    check( name, is_ok );
+    printf( "%-32s %.1f ns per call, %.0f MB/s\n", name, ns, chunk / ns * 1e3 );
+
+    return is_ok ? ns : -1;
+}
+
+static void bench_hooks()
+{
+    const int chunks[] = { 64, 4096 };
+
+    for( size_t i = 0; i < sizeof( chunks ) / sizeof( chunks[0] ); i++ )
+    {
+        std::string size = ", " + std::to_string( chunks[i] );
+
+        double own = bench_hook( ( "hooks, no gostssl" + size ).c_str(), false, false, chunks[i] );
+        double unmarked = bench_hook( ( "hooks, unmarked" + size ).c_str(), true, false, chunks[i] );
+        double fallback = bench_hook( ( "hooks, gostssl falls back" + size ).c_str(), true, true, chunks[i] );
+
+        // the marker is what keeps ordinary HTTPS out of gostssl
+        if( chunks[i] == 64 )
+            check( "unmarked skips gostssl", own > 0 && unmarked > 0 && fallback > 0 && unmarked < fallback );
+    }
+}
+
+int main()
+{
+    const char * store = "gostssl_test_hosts";
+    const char * cert_store = "gostssl_test_my.sto";
+    const char * preload = "gostssl_test_preload";
+
+    unlink( store );
+    setenv( "GOSTSSL_STORE", store, 1 );
+    setenv( "GOSTSSL_CERT_STORE", cert_store, 1 );
+    setenv( "GOSTSSL_PRELOAD", preload, 1 );
+
+    FILE * f = fopen( preload, "w" );
+
+    if( f )
+    {
+        fputs( "# test\nGOST.preload.test\n.suffix.test\n", f );
+        fclose( f );
+    }
+
+    test_bssl_init();
+
+    check( "init without RFC 9189 suites", test_old_suites() );
+
+    if( !gostssl_init( &g_bssl ) )
+    {
+        printf( "gostssl_init failed\n" );
+        return 1;
+    }
+
+    check( "csp ready", csp_ready() );
+    unlink( preload );
+
+    test_workers();
+    test_certs();
+    test_cert_store();
+    test_preload();
+    test_inference();
+    test_offload();
+    test_false_start();
+    test_write_records();
+
+    if( failed )
+    {
+        unlink( store );
+        unlink( cert_store );
+        return 1;
+    }
+
+    bench_lookups();
+    bench_allocs();
+
+    uint64_t inline_us = bench_offload( "handshakes inline", false );
+    uint64_t offloaded_us = bench_offload( "handshakes offloaded", true );
+
+    check( "offload frees network thread", offloaded_us * 2 < inline_us );
+
+    uint64_t closed_us = bench_close( "tabs closed inline", false );
+    uint64_t reclaimed_us = bench_close( "tabs closed in background", true );
+
+    check( "reclaim keeps transfers going", reclaimed_us * 4 < closed_us );
+
+    g_false_start = false;
+    double full_ms = bench_ttfb( "ttfb.test", 20, 15 );
+    g_false_start = true;
+    double early_ms = bench_ttfb( "ttfb-fs.test", 20, 15 );
+
+    printf( "%-32s %.1f ms, verify overlapped %.1f ms\n", "request on the wire", full_ms, early_ms );
+    check( "false start overlaps verify", full_ms > 0 && early_ms > 0 && early_ms < full_ms );
+
+    g_false_start = false;
+    double tls12_ms = bench_handshake( "tls12.test", false, 20, 4 );
+    g_false_start = true;
+    double tls12_fs_ms = bench_handshake( "tls12-fs.test", false, 20, 4 );
+    double tls13_ms = bench_handshake( "tls13.test", true, 20, 4 );
+
+    printf( "%-32s TLS 1.2 %.1f ms, false start %.1f ms, TLS 1.3 %.1f ms\n", "handshake at 20 ms rtt", tls12_ms, tls12_fs_ms, tls13_ms );
+    check( "TLS 1.3 handshake in a round trip", tls12_ms > 0 && tls12_fs_ms > 0 && tls13_ms > 0 && tls13_ms + 10 < tls12_ms );
+
+    bench_suites();
+    bench_reads();
+    bench_hooks();
+
+    unlink( store );
+    unlink( cert_store );
+
+    return failed ? 1 : 0;
+}
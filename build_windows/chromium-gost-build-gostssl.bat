@@ -14,6 +14,8 @@ if "%DATETIMEVERSION%" == " " (
 ( echo #define DATETIMEVERSION %DATETIMEVERSION%) > gostssl_ver.rc
 ( echo #define CHROMIUM_TAG "%CHROMIUM_TAG%") >> gostssl_ver.rc
 
+python ..\src\gostssl_preload.py || exit /b 1
+
 cl /c /Ox /Ot /GL /GF /GS /W4 /EHa /I%BORINGSSL_PATH%\include /I..\src\msspi\src /I..\src\msspi\third_party\cprocsp\include ../src/gostssl.cpp
 cl /c /Ox /Ot /GL /GF /GS /W4 /EHa ../src/msspi/src/msspi.cpp
 rc -r gostssl.rc
@@ -15,6 +15,7 @@ call git checkout -b %GOST_BRANCH% tags/%CHROMIUM_TAG%
 call git checkout -f %GOST_BRANCH%
 call gclient sync --with_branch_heads
 call git am --3way --ignore-space-change < %CHROMIUM_GOST_REPO%\patch\chromium.patch || goto :finish
+copy /y %CHROMIUM_GOST_REPO%\src\gostssl_api.h net\ssl\gostssl_api.h
 copy /y %CHROMIUM_GOST_REPO%\extra\chromium-gost.ico chrome\app\theme\chromium\win\chromium.ico
 
 copy /y %CHROMIUM_GOST_REPO%\extra\product_logo\*.png chrome\app\theme\chromium\
@@ -28,6 +29,7 @@ cd %BORINGSSL_PATH%
 call git checkout -b %GOST_BRANCH%
 call git checkout -f %GOST_BRANCH%
 call git am --3way --ignore-space-change < %CHROMIUM_GOST_REPO%\patch\boringssl.patch || goto :finish
+copy /y %CHROMIUM_GOST_REPO%\src\gostssl_api.h ssl\gostssl_api.h
 
 :finish
 if "%1"=="" timeout 86400
@@ -4,6 +4,7 @@ extern "C" {
 
 #include <openssl/ssl.h>
 #include <../ssl/internal.h>
+#include "gostssl_api.h"
 #ifdef _WIN32
 #define EXPORT __declspec(dllexport)
 #else
@@ -12,23 +13,44 @@ extern "C" {
 
     // Initialize
     EXPORT int EXPLICITSSL_CALL gostssl_init( BORINGSSL_METHOD * bssl_methods );
+    EXPORT int EXPLICITSSL_CALL gostssl_csp_state();
 
     // Functionality
-    EXPORT void EXPLICITSSL_CALL gostssl_cachestring( SSL * s, const char * cachestring );
+    EXPORT void EXPLICITSSL_CALL gostssl_cachestring( SSL * s, const char * cachestring, const char * domain );
     EXPORT int EXPLICITSSL_CALL gostssl_connect( SSL * s, int * is_gost );
     EXPORT int EXPLICITSSL_CALL gostssl_read( SSL * s, void * buf, int len, int * is_gost );
     EXPORT int EXPLICITSSL_CALL gostssl_write( SSL * s, const void * buf, int len, int * is_gost );
+    EXPORT int EXPLICITSSL_CALL gostssl_peek( SSL * s, void * buf, int len, int * is_gost );
+    EXPORT int EXPLICITSSL_CALL gostssl_pending( const SSL * s, int * is_gost );
     EXPORT void EXPLICITSSL_CALL gostssl_free( SSL * s );
 
     // Markers
     EXPORT int EXPLICITSSL_CALL gostssl_tls_gost_required( SSL * s );
 
     // Hooks
-    EXPORT void EXPLICITSSL_CALL gostssl_certhook( void * cert, int size );
+    EXPORT void EXPLICITSSL_CALL gostssl_certbind( void * s, void * cert, int size );
     EXPORT void EXPLICITSSL_CALL gostssl_verifyhook( void * s, unsigned * is_gost );
     EXPORT void EXPLICITSSL_CALL gostssl_clientcertshook( char *** certs, int ** lens, int * count, int * is_gost );
     EXPORT void EXPLICITSSL_CALL gostssl_isgostcerthook( void * cert, int size, int * is_gost );
 
+    // Private keys
+    EXPORT void EXPLICITSSL_CALL gostssl_keys_flush( void * cert, int size );
+
+    // Asynchronous verification
+    EXPORT int EXPLICITSSL_CALL gostssl_verify_start( void * s, gostssl_verify_cb done, void * arg );
+    EXPORT int EXPLICITSSL_CALL gostssl_verify_poll( void * s, unsigned * gost_status );
+    EXPORT void EXPLICITSSL_CALL gostssl_verify_cancel( void * s );
+    EXPORT void EXPLICITSSL_CALL gostssl_verify_invalidate( const char * hostname );
+
+    // Handshake offload
+    EXPORT int EXPLICITSSL_CALL gostssl_handshake_wake( SSL * s, gostssl_wake_cb wake, void * arg );
+
+    // Statistics
+    EXPORT void EXPLICITSSL_CALL gostssl_counters( const char *** names, unsigned long long ** values, int * count );
+
+    // Function table
+    EXPORT const GOSTSSL_API * EXPLICITSSL_CALL gostssl_api( unsigned version );
+
 #if defined( __cplusplus )
 }
 #endif
@@ -43,13 +65,29 @@ extern "C" {
 #include "WinCryptEx.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pwd.h>
+#endif
 #define _SILENCE_STDEXT_HASH_DEPRECATION_WARNINGS
-#include <map>
-#include <unordered_map>
 #include <string>
 #include <vector>
+#include <list>
+#include <map>
+#include <algorithm>
+#include <deque>
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <chrono>
 
 #include "msspi.h"
 
@@ -60,41 +98,304 @@ static GOSTSSL_METHOD gssl = {
     gostssl_read,
     gostssl_write,
     gostssl_free,
-    gostssl_tls_gost_required
+    gostssl_tls_gost_required,
+    gostssl_csp_state,
+    gostssl_peek,
+    gostssl_pending,
+};
+
+static const GOSTSSL_API g_api = {
+    GOSTSSL_API_VERSION,
+    sizeof( GOSTSSL_API ),
+
+    gostssl_init,
+    gostssl_connect,
+    gostssl_read,
+    gostssl_write,
+    gostssl_peek,
+    gostssl_pending,
+    gostssl_free,
+    gostssl_tls_gost_required,
+
+    gostssl_cachestring,
+    gostssl_certbind,
+    gostssl_verifyhook,
+    gostssl_clientcertshook,
+    gostssl_isgostcerthook,
+    gostssl_verify_start,
+    gostssl_verify_poll,
+    gostssl_verify_cancel,
+    gostssl_verify_invalidate,
+    gostssl_keys_flush,
+    gostssl_counters,
+    gostssl_handshake_wake,
+    gostssl_csp_state,
 };
 
+const GOSTSSL_API * gostssl_api( unsigned version )
+{
+    return version == GOSTSSL_API_VERSION ? &g_api : NULL;
+}
+
 static BORINGSSL_METHOD * bssls = NULL;
 
 #define TLS_GOST_CIPHER_2001 0x0081
 #define TLS_GOST_CIPHER_2012 0xFF85
+#define TLS_GOST_CIPHER_KUZNYECHIK 0xC100
+#define TLS_GOST_CIPHER_MAGMA 0xC101
 
 static const SSL_CIPHER * tlsgost2001 = NULL;
 static const SSL_CIPHER * tlsgost2012 = NULL;
-static char g_is_gost = 0;
+static const SSL_CIPHER * tlsgostkuznyechik = NULL;
+static const SSL_CIPHER * tlsgostmagma = NULL;
+// a GOST server asked for a client certificate at least once
+static std::atomic<char> g_is_gost( 0 );
+static int g_worker_index = -1;
+
+// counters
+
+#define GOSTSSL_COUNTERS( X ) \
+    X( host_probes ) \
+    X( host_probes_limited ) \
+    X( host_auto_to_probing ) \
+    X( host_auto_to_no ) \
+    X( host_probing_to_probing ) \
+    X( host_probing_to_yes ) \
+    X( host_probing_to_no ) \
+    X( host_yes_to_yes ) \
+    X( host_yes_to_auto ) \
+    X( host_no_to_auto ) \
+    X( host_no_to_probing ) \
+    X( host_no_to_yes ) \
+    X( host_inferred ) \
+    X( host_inferred_confirmed ) \
+    X( host_inferred_failed ) \
+    X( host_propagated ) \
+    X( session_hits ) \
+    X( session_misses ) \
+    X( session_stored ) \
+    X( session_expired ) \
+    X( session_evictions ) \
+    X( session_dropped ) \
+    X( verify_cache_hits ) \
+    X( verify_cache_misses ) \
+    X( verify_cache_evictions ) \
+    X( verify_cache_invalidations ) \
+    X( io_bio_reads ) \
+    X( io_direct_bytes ) \
+    X( io_buffered_bytes ) \
+    X( io_bio_writes ) \
+    X( io_written_bytes ) \
+    X( io_plain_direct_bytes ) \
+    X( io_plain_buffered_bytes ) \
+    X( write_calls ) \
+    X( write_records ) \
+    X( write_record_bytes ) \
+    X( write_small_records ) \
+    X( suite_2001_bytes ) \
+    X( suite_2012_bytes ) \
+    X( suite_kuznyechik_bytes ) \
+    X( suite_magma_bytes ) \
+    X( client_certs_hits ) \
+    X( client_certs_rebuilds ) \
+    X( workers_allocated ) \
+    X( workers_reused ) \
+    X( msspi_opened ) \
+    X( msspi_reclaimed ) \
+    X( init_us ) \
+    X( csp_probe_us ) \
+    X( csp_waits ) \
+    X( csp_wait_us ) \
+    X( handshake_jobs ) \
+    X( handshake_offloaded_us ) \
+    X( handshake_inline_us ) \
+    X( false_starts ) \
+    X( false_start_bytes ) \
+    X( false_start_mismatches ) \
+    X( handshakes_tls12 ) \
+    X( handshakes_tls13 ) \
+    X( handshake_tls12_us ) \
+    X( handshake_tls13_us )
+
+#define GOSTSSL_COUNTER_ID( name ) GOSTSSL_COUNTER_##name,
+#define GOSTSSL_COUNTER_NAME( name ) #name,
 
-int gostssl_init( BORINGSSL_METHOD * bssl_methods )
+typedef enum
 {
-    bssls = bssl_methods;
+    GOSTSSL_COUNTERS( GOSTSSL_COUNTER_ID )
+    GOSTSSL_COUNTERS_COUNT
+}
+GOSTSSL_COUNTER;
+
+static const char * g_counters_names[] = { GOSTSSL_COUNTERS( GOSTSSL_COUNTER_NAME ) };
+static std::atomic<unsigned long long> g_counters[GOSTSSL_COUNTERS_COUNT];
+
+#define GOSTSSL_COUNT( name ) GOSTSSL_COUNT_N( name, 1 )
+#define GOSTSSL_COUNT_N( name, n ) g_counters[GOSTSSL_COUNTER_##name].fetch_add( n, std::memory_order_relaxed )
+
+void gostssl_counters( const char *** names, unsigned long long ** values, int * count )
+{
+    static thread_local unsigned long long snapshot[GOSTSSL_COUNTERS_COUNT];
+
+    for( size_t i = 0; i < GOSTSSL_COUNTERS_COUNT; i++ )
+        snapshot[i] = g_counters[i].load( std::memory_order_relaxed );
+
+    *names = g_counters_names;
+    *values = snapshot;
+    *count = GOSTSSL_COUNTERS_COUNT;
+}
+
+static unsigned gostssl_config( const char * name, unsigned value )
+{
+    const char * env = getenv( name );
 
+    if( env && *env )
+    {
+        char * end;
+        unsigned long env_value = strtoul( env, &end, 10 );
+
+        if( !*end )
+            value = (unsigned)env_value;
+    }
+
+    return value;
+}
+
+static void host_status_init();
+static void preload_init();
+static void session_init();
+static void verify_cache_init();
+static void io_init();
+static void workers_init();
+
+// CSP readiness
+//
+// loading and initializing the CSP can take long on a cold machine, it is
+// probed on a background thread started by gostssl_init, so the first
+// navigation does not wait for it, only connections that are about to
+// use msspi wait for the probe to finish
+
+typedef enum
+{
+    CSP_PENDING,
+    CSP_READY,
+    CSP_FAILED,
+}
+CSP_STATE;
+
+static std::atomic<int> g_csp_state( CSP_PENDING );
+static std::mutex g_csp_mutex;
+static std::condition_variable g_csp_cv;
+
+static uint64_t gostssl_time_us()
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+static bool csp_probe()
+{
     MSSPI_HANDLE h = msspi_open( NULL, (msspi_read_cb)(uintptr_t)1, (msspi_write_cb)(uintptr_t)1 );
     if( !h )
-        return 0;
+        return false;
 
     msspi_close( h );
 
     HCRYPTPROV hProv;
 
     if( !CryptAcquireContext( &hProv, NULL, NULL, PROV_GOST_2001_DH, CRYPT_VERIFYCONTEXT | CRYPT_SILENT ) )
-        return 0;
+        return false;
 
     CryptReleaseContext( hProv, 0 );
 
+    // warm the 2012 provider as well, not required
+    if( CryptAcquireContext( &hProv, NULL, NULL, PROV_GOST_2012_256, CRYPT_VERIFYCONTEXT | CRYPT_SILENT ) )
+        CryptReleaseContext( hProv, 0 );
+
+    return true;
+}
+
+static void csp_probe_thread()
+{
+    uint64_t start = gostssl_time_us();
+    int state = csp_probe() ? CSP_READY : CSP_FAILED;
+    GOSTSSL_COUNT_N( csp_probe_us, gostssl_time_us() - start );
+
+    {
+        std::unique_lock<std::mutex> lck( g_csp_mutex );
+        g_csp_state.store( state, std::memory_order_release );
+    }
+
+    g_csp_cv.notify_all();
+}
+
+// true once the CSP is usable, blocks while the probe is running
+static bool csp_ready()
+{
+    int state = g_csp_state.load( std::memory_order_acquire );
+
+    if( state == CSP_PENDING )
+    {
+        uint64_t start = gostssl_time_us();
+
+        {
+            std::unique_lock<std::mutex> lck( g_csp_mutex );
+
+            while( g_csp_state.load( std::memory_order_relaxed ) == CSP_PENDING )
+                g_csp_cv.wait( lck );
+
+            state = g_csp_state.load( std::memory_order_relaxed );
+        }
+
+        GOSTSSL_COUNT( csp_waits );
+        GOSTSSL_COUNT_N( csp_wait_us, gostssl_time_us() - start );
+    }
+
+    return state == CSP_READY;
+}
+
+// 1 once the CSP is usable, 0 while the probe is running, -1 without a CSP,
+// never blocks, boringssl does not offer GOST suites on -1
+int gostssl_csp_state()
+{
+    int state = g_csp_state.load( std::memory_order_acquire );
+
+    return state == CSP_READY ? 1 : state == CSP_FAILED ? -1 : 0;
+}
+
+int gostssl_init( BORINGSSL_METHOD * bssl_methods )
+{
+    uint64_t start = gostssl_time_us();
+
+    bssls = bssl_methods;
+
     tlsgost2001 = bssls->SSL_get_cipher_by_value( TLS_GOST_CIPHER_2001 );
     tlsgost2012 = bssls->SSL_get_cipher_by_value( TLS_GOST_CIPHER_2012 );
+    tlsgostkuznyechik = bssls->SSL_get_cipher_by_value( TLS_GOST_CIPHER_KUZNYECHIK );
+    tlsgostmagma = bssls->SSL_get_cipher_by_value( TLS_GOST_CIPHER_MAGMA );
 
+    // the RFC 9189 suites are optional, a boringssl without them
+    // still runs the GOST 28147 ones
     if( !tlsgost2001 || !tlsgost2012 )
         return 0;
 
+    // worker slot in SSL ex_data
+    g_worker_index = bssls->SSL_get_ex_new_index( 0, NULL, NULL, NULL, NULL );
+
+    if( g_worker_index < 0 )
+        return 0;
+
+    host_status_init();
+    preload_init();
+    session_init();
+    verify_cache_init();
+    io_init();
+    workers_init();
+
+    std::thread( csp_probe_thread ).detach();
+
+    GOSTSSL_COUNT_N( init_us, gostssl_time_us() - start );
+
     (void)gssl;
 
     return 1;
@@ -105,52 +406,245 @@ typedef enum
     GOSTSSL_HOST_AUTO = 0,
     GOSTSSL_HOST_YES = 1,
     GOSTSSL_HOST_NO = 2,
-    GOSTSSL_HOST_PROBING = 16,
-    GOSTSSL_HOST_PROBING_END = 31
+    GOSTSSL_HOST_PROBING = 16
 }
 GOSTSSL_HOST_STATUS;
 
+// host decision with its timing,
+// |expires| is wall-clock seconds (0 - never), |fails| counts failed
+// msspi handshakes in a row, |probes| counts round trips spent on
+// probing within the hour that started at |window|
+struct HOST_STATE
+{
+    uint8_t status;
+    uint8_t fails;
+    uint16_t probes;
+    uint32_t expires;
+    uint32_t window;
+};
+
+struct GostSSL_Worker;
+
+struct VERIFY_JOB
+{
+    VERIFY_JOB()
+    {
+        w = NULL;
+        done = NULL;
+        arg = NULL;
+        gost_status = 0;
+        is_done = false;
+        is_canceled = false;
+        is_orphan = false;
+    }
+
+    GostSSL_Worker * w;
+    gostssl_verify_cb done;
+    void * arg;
+    unsigned gost_status;
+    bool is_done;
+    bool is_canceled;
+    bool is_orphan;
+};
+
+static void msspi_reclaim( MSSPI_HANDLE h );
+
 struct GostSSL_Worker
 {
     GostSSL_Worker()
     {
         h = NULL;
-        s = NULL;
-        host_status = GOSTSSL_HOST_AUTO;
+        verify = NULL;
+        client_cert = NULL;
+        wake = NULL;
+        wake_arg = NULL;
+        reset();
     }
 
     ~GostSSL_Worker()
+    {
+        reset();
+    }
+
+    // back to a fresh worker, buffers keep their capacity
+    void reset()
     {
         if( h )
-            msspi_close( h );
+        {
+            msspi_reclaim( h );
+            h = NULL;
+        }
+        if( client_cert )
+        {
+            CertFreeCertificateContext( client_cert );
+            client_cert = NULL;
+        }
+        if( verify )
+        {
+            delete verify;
+            verify = NULL;
+        }
+        if( wake )
+        {
+            wake( wake_arg, 1 );
+            wake = NULL;
+            wake_arg = NULL;
+        }
+
+        s = NULL;
+        host_status = GOSTSSL_HOST_AUTO;
+        suite_bytes = GOSTSSL_COUNTERS_COUNT;
+        host_string.clear();
+        cachestring.clear();
+        host_domain.clear();
+        host_inferred.clear();
+        is_handshake_started = false;
+        is_handshake_done = false;
+        handshake_start_us = 0;
+        session_generation = 0;
+        rbuf_head = 0;
+        rbuf_tail = 0;
+        pbuf_head = 0;
+        pbuf_tail = 0;
+        is_cert_selected = false;
+        obuf.clear();
+        obuf_head = 0;
+        handshake_job = 0;
+        handshake_ret = 0;
+        is_offloaded = false;
+        is_handshake_orphan = false;
+        is_false_start = false;
+        early.clear();
+        false_start_key.clear();
     }
 
     MSSPI_HANDLE h;
     SSL * s;
     GOSTSSL_HOST_STATUS host_status;
+    GOSTSSL_COUNTER suite_bytes;
     std::string host_string;
+    std::string cachestring;
+    std::string host_domain;
+    std::string host_inferred;
+    bool is_handshake_started;
+    bool is_handshake_done;
+    uint64_t handshake_start_us;
+    uint64_t session_generation;
+    VERIFY_JOB * verify;
+    std::vector<char> rbuf;
+    size_t rbuf_head;
+    size_t rbuf_tail;
+    std::vector<char> pbuf;
+    size_t pbuf_head;
+    size_t pbuf_tail;
+    PCCERT_CONTEXT client_cert;
+    bool is_cert_selected;
+    gostssl_wake_cb wake;
+    void * wake_arg;
+    std::vector<char> obuf;
+    size_t obuf_head;
+    int handshake_job;
+    int handshake_ret;
+    bool is_offloaded;
+    bool is_handshake_orphan;
+    bool is_false_start;
+    std::vector<char> early;
+    std::string false_start_key;
 };
 
+// ciphertext read-ahead
+//
+// msspi asks for records piece by piece, small reads are served from one
+// large BIO read, a read with nothing buffered that can take a whole
+// record goes straight into msspi's buffer; this batches BIO reads, it
+// saves no copies beyond that: msspi decrypts in its own buffer and
+// copies out, and encrypts what it writes, gostssl can neither decrypt
+// in place nor gather writes
+
+#define GOSTSSL_READ_AHEAD ( 64 * 1024 )
+#define GOSTSSL_READ_DIRECT ( 5 + 16384 + 2048 )
+
+static unsigned g_read_ahead = GOSTSSL_READ_AHEAD;
+
+static void io_init()
+{
+    g_read_ahead = gostssl_config( "GOSTSSL_READ_AHEAD", GOSTSSL_READ_AHEAD );
+}
+
 static int gostssl_read_cb( GostSSL_Worker * w, void * buf, int len )
 {
-    return bssls->BIO_read( w->s->rbio, buf, len );
+    if( w->rbuf_head == w->rbuf_tail )
+    {
+        // offloaded handshakes never touch the BIO
+        if( w->is_offloaded )
+            return -1;
+
+        if( !g_read_ahead || len >= GOSTSSL_READ_DIRECT || (unsigned)len >= g_read_ahead / 2 )
+        {
+            int ret = bssls->BIO_read( w->s->rbio, buf, len );
+
+            GOSTSSL_COUNT( io_bio_reads );
+
+            if( ret > 0 )
+                GOSTSSL_COUNT_N( io_direct_bytes, ret );
+
+            return ret;
+        }
+
+        if( w->rbuf.size() != g_read_ahead )
+            w->rbuf.resize( g_read_ahead );
+
+        int ret = bssls->BIO_read( w->s->rbio, &w->rbuf[0], (int)w->rbuf.size() );
+
+        GOSTSSL_COUNT( io_bio_reads );
+
+        if( ret <= 0 )
+            return ret;
+
+        w->rbuf_head = 0;
+        w->rbuf_tail = (size_t)ret;
+    }
+
+    size_t n = w->rbuf_tail - w->rbuf_head;
+
+    if( n > (size_t)len )
+        n = (size_t)len;
+
+    memcpy( buf, &w->rbuf[w->rbuf_head], n );
+    w->rbuf_head += n;
+
+    GOSTSSL_COUNT_N( io_buffered_bytes, n );
+
+    return (int)n;
 }
 
 static int gostssl_write_cb( GostSSL_Worker * w, const void * buf, int len )
 {
-    return bssls->BIO_write( w->s->wbio, buf, len );
-}
+    if( w->is_offloaded )
+    {
+        w->obuf.insert( w->obuf.end(), (const char *)buf, (const char *)buf + len );
+        return len;
+    }
 
-static PCCERT_CONTEXT gcert = NULL;
+    int ret = bssls->BIO_write( w->s->wbio, buf, len );
 
-static int gostssl_cert_cb( GostSSL_Worker * w )
+    GOSTSSL_COUNT( io_bio_writes );
+
+    if( ret > 0 )
+        GOSTSSL_COUNT_N( io_written_bytes, ret );
+
+    return ret;
+}
+
+// asks the application for the client certificate, 1 once it answered
+static int gostssl_cert_select( GostSSL_Worker * w )
 {
     if( w->s->cert && w->s->cert->cert_cb )
     {
-        if( gcert )
+        if( w->client_cert )
         {
-            CertFreeCertificateContext( gcert );
-            gcert = NULL;
+            CertFreeCertificateContext( w->client_cert );
+            w->client_cert = NULL;
         }
 
         // mimic ssl3_get_certificate_request
@@ -189,39 +683,47 @@ static int gostssl_cert_cb( GostSSL_Worker * w )
         }
 
         g_is_gost = 1;
+
+        // the callback binds the chosen certificate through gostssl_certbind
         int ret = w->s->cert->cert_cb( w->s, w->s->cert->cert_cb_arg );
 
-        if( !gcert )
+        if( !w->client_cert )
         {
             if( ret <= 0 )
                 return ret;
         }
-
-        if( gcert )
-        {
-            if( msspi_set_mycert( w->h, (const char *)gcert->pbCertEncoded, gcert->cbCertEncoded ) )
-                bssls->ERR_clear_error();
-
-            CertFreeCertificateContext( gcert );
-            gcert = NULL;
-        }
     }
 
+    w->is_cert_selected = true;
     return 1;
 }
 
-void gostssl_certhook( void * cert, int size )
+static int gostssl_cert_cb( GostSSL_Worker * w )
 {
-    if( !cert )
-        return;
+    if( !w->is_cert_selected )
+    {
+        // the application is asked on the network thread only
+        if( w->is_offloaded )
+            return -1;
 
-    if( gcert )
-        return;
+        int ret = gostssl_cert_select( w );
 
-    if( size == 0 )
-        gcert = CertDuplicateCertificateContext( (PCCERT_CONTEXT)cert );
-    else
-        gcert = CertCreateCertificateContext( X509_ASN_ENCODING, (BYTE *)cert, size );
+        if( ret <= 0 )
+            return ret;
+    }
+
+    w->is_cert_selected = false;
+
+    if( w->client_cert )
+    {
+        if( msspi_set_mycert( w->h, (const char *)w->client_cert->pbCertEncoded, w->client_cert->cbCertEncoded ) )
+            bssls->ERR_clear_error();
+
+        CertFreeCertificateContext( w->client_cert );
+        w->client_cert = NULL;
+    }
+
+    return 1;
 }
 
 void gostssl_isgostcerthook( void * cert, int size, int * is_gost )
@@ -249,597 +751,3242 @@ void gostssl_isgostcerthook( void * cert, int size, int * is_gost )
     return;
 }
 
-typedef std::map< void *, GostSSL_Worker * > WORKERS_DB;
-typedef std::unordered_map< std::string, GOSTSSL_HOST_STATUS > HOST_STATUSES_DB;
-typedef std::pair< std::string, GOSTSSL_HOST_STATUS > HOST_STATUSES_DB_PAIR;
+// host statuses table
+//
+// readers never lock: a table is published through g_hosts and
+// retired tables are reclaimed after an rcu-style grace period,
+// writers are serialized by g_hosts_mutex and never block readers
+//
+// inserts and status updates are done in place, keys are interned
+// into the table arena once, eviction is CLOCK over referenced bits,
+// the table is rebuilt (compacted) when tombstones or arena run out
 
-static WORKERS_DB workers_db;
-static HOST_STATUSES_DB host_statuses_db;
-static std::recursive_mutex gmutex;
+#define GOSTSSL_HOSTS_MAX 4096
+#define GOSTSSL_HOST_KEY_AVG 64
+#define GOSTSSL_HOST_KEY_MAX 1024
 
-static void host_status_set( std::string & site, GOSTSSL_HOST_STATUS status )
-{
-    std::unique_lock<std::recursive_mutex> lck( gmutex );
+#define HOST_SLOT_EMPTY 0
+#define HOST_SLOT_REMOVED 1
 
-    HOST_STATUSES_DB::iterator lb = host_statuses_db.find( site );
+struct HOST_ENTRY
+{
+    std::atomic<uint32_t> hash;
+    uint32_t key_offset;
+    uint32_t key_len;
+    std::atomic<uint8_t> status;
+    std::atomic<uint8_t> ref;
+    std::atomic<uint32_t> expires;
+    // writers only
+    uint8_t fails;
+    uint16_t probes;
+    uint32_t window;
+};
 
-    if( lb != host_statuses_db.end() )
+struct HOST_TABLE
+{
+    HOST_TABLE( size_t capacity )
     {
-        if( lb->second != GOSTSSL_HOST_NO && lb->second != GOSTSSL_HOST_YES )
-            lb->second = status;
+        size_t size = 16;
+
+        while( size < capacity * 2 )
+            size <<= 1;
+
+        this->capacity = capacity;
+        mask = size - 1;
+        count = 0;
+        used = 0;
+        clock_hand = 0;
+        arena_size = capacity * GOSTSSL_HOST_KEY_AVG;
+        if( arena_size < GOSTSSL_HOST_KEY_MAX * 4 )
+            arena_size = GOSTSSL_HOST_KEY_MAX * 4;
+        arena_used = 0;
+
+        slots = new HOST_ENTRY[size];
+        arena = new char[arena_size];
+
+        for( size_t i = 0; i < size; i++ )
+            slots[i].hash.store( HOST_SLOT_EMPTY, std::memory_order_relaxed );
     }
-    else
+
+    ~HOST_TABLE()
     {
-        host_statuses_db.insert( lb, HOST_STATUSES_DB_PAIR( site, status ) );
+        delete[] slots;
+        delete[] arena;
     }
-}
 
-#if defined( _WIN32 ) && defined( W_SITES )
+    size_t capacity;
+    size_t mask;
+    size_t count;
+    size_t used;
+    size_t clock_hand;
+    size_t arena_size;
+    size_t arena_used;
+    HOST_ENTRY * slots;
+    char * arena;
+};
 
-#define REGISTRY_TREE01 "Software"
-#define REGISTRY_TREE02 "Crypto Pro"
-#define REGISTRY_TREE03 "gostssl"
-#define REGISTRY_CHROME_SITES "_sites"
+static std::atomic<HOST_TABLE *> g_hosts( NULL );
+static std::mutex g_hosts_mutex;
+static size_t g_hosts_max = GOSTSSL_HOSTS_MAX;
 
-static HKEY hKeyChromeRegistryDir = 0;
+#define GOSTSSL_YES_TTL ( 7 * 24 * 3600 )
+#define GOSTSSL_NO_TTL ( 10 * 60 )
+#define GOSTSSL_NO_TTL_MAX ( 24 * 3600 )
+#define GOSTSSL_PROBE_ATTEMPTS 3
+#define GOSTSSL_PROBES_PER_HOUR 16
 
-VOID CloseChromeRegistryDir()
+static unsigned g_yes_ttl = GOSTSSL_YES_TTL;
+static unsigned g_no_ttl = GOSTSSL_NO_TTL;
+static unsigned g_no_ttl_max = GOSTSSL_NO_TTL_MAX;
+static unsigned g_probe_attempts = GOSTSSL_PROBE_ATTEMPTS;
+static unsigned g_probes_per_hour = GOSTSSL_PROBES_PER_HOUR;
+
+static void host_store_open();
+static void host_store_set( const std::string & site, const HOST_STATE & st );
+
+static void host_status_init()
 {
-    if( hKeyChromeRegistryDir )
-    {
-        RegCloseKey( hKeyChromeRegistryDir );
-        hKeyChromeRegistryDir = 0;
-    }
+    g_hosts_max = gostssl_config( "GOSTSSL_HOSTS_MAX", GOSTSSL_HOSTS_MAX );
+    g_yes_ttl = gostssl_config( "GOSTSSL_YES_TTL", GOSTSSL_YES_TTL );
+    g_no_ttl = gostssl_config( "GOSTSSL_NO_TTL", GOSTSSL_NO_TTL );
+    g_no_ttl_max = gostssl_config( "GOSTSSL_NO_TTL_MAX", GOSTSSL_NO_TTL_MAX );
+    g_probe_attempts = gostssl_config( "GOSTSSL_PROBE_ATTEMPTS", GOSTSSL_PROBE_ATTEMPTS );
+    g_probes_per_hour = gostssl_config( "GOSTSSL_PROBES_PER_HOUR", GOSTSSL_PROBES_PER_HOUR );
+
+    if( !g_hosts_max )
+        g_hosts_max = 1;
+    if( !g_probe_attempts )
+        g_probe_attempts = 1;
+
+    host_store_open();
 }
 
-BOOL OpenChromeRegistryDir( CHAR * szDir, BOOL is_write )
+#define GOSTSSL_RCU_SLOTS 16
+
+struct RCU_SLOT
 {
-    HKEY hKey = 0;
-    HKEY hKeyChild = 0;
-    REGSAM RW = KEY_READ | ( is_write ? KEY_WRITE : 0 );
-    CHAR szChromeRegistryDir[MAX_PATH] = { 0 };
-    int i;
+    std::atomic<unsigned> readers[2];
+    char pad[64 - 2 * sizeof( std::atomic<unsigned> )];
+};
 
-    CloseChromeRegistryDir();
+static RCU_SLOT g_rcu[GOSTSSL_RCU_SLOTS];
+static std::atomic<unsigned> g_rcu_epoch( 0 );
 
-    if( -1 == sprintf_s( szChromeRegistryDir, _countof( szChromeRegistryDir ), REGISTRY_TREE01 "\\" REGISTRY_TREE02 "\\" REGISTRY_TREE03 "\\%s", szDir ) )
-        return FALSE;
+static RCU_SLOT & rcu_slot()
+{
+    static std::atomic<unsigned> next( 0 );
+    static thread_local unsigned index = next++ % GOSTSSL_RCU_SLOTS;
+    return g_rcu[index];
+}
 
-    for( i = 0; i < 5; i++ )
+static unsigned rcu_read_lock()
+{
+    RCU_SLOT & slot = rcu_slot();
+
+    for( ;; )
     {
-        if( hKey )
-        {
-            RegCloseKey( hKey );
-            hKey = 0;
-        }
+        unsigned epoch = g_rcu_epoch.load() & 1;
+        slot.readers[epoch]++;
 
-        if( hKeyChild )
-        {
-            RegCloseKey( hKeyChild );
-            hKeyChild = 0;
-        }
+        if( ( g_rcu_epoch.load() & 1 ) == epoch )
+            return epoch;
 
-        if( hKeyChromeRegistryDir )
-            return TRUE;
+        slot.readers[epoch]--;
+    }
+}
 
-        if( RegOpenKeyExA( HKEY_CURRENT_USER, szChromeRegistryDir, 0, RW, &hKey ) )
-        {
-            if( !is_write )
-                break;
+static void rcu_read_unlock( unsigned epoch )
+{
+    rcu_slot().readers[epoch]--;
+}
 
-            if( RegOpenKeyExA( HKEY_CURRENT_USER, REGISTRY_TREE01 "\\" REGISTRY_TREE02 "\\" REGISTRY_TREE03, 0, RW, &hKey ) )
-            {
-                if( RegOpenKeyExA( HKEY_CURRENT_USER, REGISTRY_TREE01 "\\" REGISTRY_TREE02, 0, RW, &hKey ) )
-                {
-                    if( RegOpenKeyExA( HKEY_CURRENT_USER, REGISTRY_TREE01, 0, RW, &hKey ) )
-                        break;
+// writers only (under g_hosts_mutex)
+static void rcu_synchronize()
+{
+    unsigned epoch = g_rcu_epoch++ & 1;
 
-                    if( RegCreateKeyA( hKey, REGISTRY_TREE02, &hKeyChild ) )
-                        break;
+    for( size_t i = 0; i < GOSTSSL_RCU_SLOTS; i++ )
+        while( g_rcu[i].readers[epoch].load() )
+            std::this_thread::yield();
+}
 
-                    continue;
-                }
+static uint32_t host_hash( const char * key, size_t len )
+{
+    uint32_t h = 2166136261u;
 
-                if( RegCreateKeyA( hKey, REGISTRY_TREE03, &hKeyChild ) )
-                    break;
+    for( size_t i = 0; i < len; i++ )
+    {
+        h ^= (uint8_t)key[i];
+        h *= 16777619u;
+    }
 
-                continue;
-            }
+    if( h == HOST_SLOT_EMPTY || h == HOST_SLOT_REMOVED )
+        h += 2;
 
-            if( RegCreateKeyA( hKey, szDir, &hKeyChild ) )
-                break;
+    return h;
+}
 
-            continue;
-        }
+static HOST_ENTRY * host_table_find( HOST_TABLE * t, const std::string & site, uint32_t h )
+{
+    for( size_t i = h & t->mask, n = 0; n <= t->mask; i = ( i + 1 ) & t->mask, n++ )
+    {
+        HOST_ENTRY * e = &t->slots[i];
+        uint32_t e_hash = e->hash.load( std::memory_order_acquire );
 
-        hKeyChromeRegistryDir = hKey;
-        hKey = 0;
+        if( e_hash == HOST_SLOT_EMPTY )
+            break;
+
+        if( e_hash == h &&
+            e->key_len == site.size() &&
+            0 == memcmp( t->arena + e->key_offset, site.data(), site.size() ) )
+            return e;
     }
 
-    return FALSE;
+    return NULL;
 }
 
-static BOOL isChromeSitesOpened = FALSE;
-
-BOOL GetChromeDWORDEx( LPCSTR szKey, DWORD * dwValue )
+static void host_entry_state( HOST_ENTRY * e, HOST_STATE & st )
 {
-    if( !hKeyChromeRegistryDir )
-        return 0;
-
-    DWORD dwLen = sizeof( *dwValue );
-
-    if( ERROR_SUCCESS != RegQueryValueExA( hKeyChromeRegistryDir, szKey, NULL, 0, (BYTE *)dwValue, &dwLen ) )
-        return FALSE;
-
-    return TRUE;
+    st.status = e->status.load( std::memory_order_relaxed );
+    st.expires = e->expires.load( std::memory_order_relaxed );
+    st.fails = e->fails;
+    st.probes = e->probes;
+    st.window = e->window;
 }
 
-GOSTSSL_HOST_STATUS host_status_first( const char * site )
+static void host_table_put( HOST_TABLE * t, const char * key, size_t key_len, uint32_t h, const HOST_STATE & st, uint8_t ref )
 {
-    if( !isChromeSitesOpened )
-    {
-        if( !OpenChromeRegistryDir( REGISTRY_CHROME_SITES, FALSE ) )
-            return GOSTSSL_HOST_AUTO;
-
-        isChromeSitesOpened = TRUE;
-    }
+    size_t i = h & t->mask;
+
+    while( t->slots[i].hash.load( std::memory_order_relaxed ) != HOST_SLOT_EMPTY )
+        i = ( i + 1 ) & t->mask;
+
+    HOST_ENTRY * e = &t->slots[i];
+
+    memcpy( t->arena + t->arena_used, key, key_len );
+    e->key_offset = (uint32_t)t->arena_used;
+    e->key_len = (uint32_t)key_len;
+    e->status.store( st.status, std::memory_order_relaxed );
+    e->expires.store( st.expires, std::memory_order_relaxed );
+    e->fails = st.fails;
+    e->probes = st.probes;
+    e->window = st.window;
+    e->ref.store( ref, std::memory_order_relaxed );
+    e->hash.store( h, std::memory_order_release );
+
+    t->arena_used += key_len;
+    t->count++;
+    t->used++;
+}
 
+static void host_table_evict( HOST_TABLE * t )
+{
+    for( size_t n = 0; n <= 2 * t->mask + 1; n++ )
     {
-        DWORD dwStatus;
+        HOST_ENTRY * e = &t->slots[t->clock_hand];
+        t->clock_hand = ( t->clock_hand + 1 ) & t->mask;
 
-        if( !GetChromeDWORDEx( site, &dwStatus ) )
-            return GOSTSSL_HOST_AUTO;
+        if( e->hash.load( std::memory_order_relaxed ) <= HOST_SLOT_REMOVED )
+            continue;
 
-        switch( dwStatus )
+        if( e->ref.load( std::memory_order_relaxed ) )
         {
-            case GOSTSSL_HOST_YES:
-            case GOSTSSL_HOST_NO:
-            case GOSTSSL_HOST_AUTO:
-                host_status_set( site, (GOSTSSL_HOST_STATUS)dwStatus );
-                return (GOSTSSL_HOST_STATUS)dwStatus;
-
-            default:
-                return GOSTSSL_HOST_AUTO;
+            e->ref.store( 0, std::memory_order_relaxed );
+            continue;
         }
+
+        e->hash.store( HOST_SLOT_REMOVED, std::memory_order_release );
+        t->count--;
+        return;
     }
 }
 
-#else
-
-GOSTSSL_HOST_STATUS host_status_first( std::string & site )
+// writers only (under g_hosts_mutex)
+static HOST_TABLE * host_table_rebuild( HOST_TABLE * t )
 {
-    (void)site;
-    return GOSTSSL_HOST_AUTO;
-}
-
-#endif
+    HOST_TABLE * t_new = new HOST_TABLE( g_hosts_max );
 
-GOSTSSL_HOST_STATUS host_status_get( std::string & site )
-{
-    if( host_statuses_db.size() )
+    if( t )
     {
-        std::unique_lock<std::recursive_mutex> lck( gmutex );
+        for( size_t i = 0; i <= t->mask; i++ )
+        {
+            HOST_ENTRY * e = &t->slots[i];
+            uint32_t e_hash = e->hash.load( std::memory_order_relaxed );
+
+            if( e_hash <= HOST_SLOT_REMOVED )
+                continue;
 
-        HOST_STATUSES_DB::iterator lb = host_statuses_db.find( site );
+            if( t_new->count >= t_new->capacity ||
+                t_new->arena_used + e->key_len > t_new->arena_size )
+                break;
 
-        if( lb != host_statuses_db.end() )
-            return lb->second;
+            HOST_STATE st;
+            host_entry_state( e, st );
+            host_table_put( t_new, t->arena + e->key_offset, e->key_len, e_hash, st,
+                            e->ref.load( std::memory_order_relaxed ) );
+        }
     }
 
-    return host_status_first( site );
-}
+    g_hosts.store( t_new, std::memory_order_release );
 
-typedef enum
-{
-    WDB_SEARCH,
-    WDB_NEW,
-    WDB_FREE,
+    if( t )
+    {
+        rcu_synchronize();
+        delete t;
+    }
+
+    return t_new;
 }
-WORKER_DB_ACTION;
 
-GostSSL_Worker * workers_api( SSL * s, WORKER_DB_ACTION action, const char * cachestring = NULL )
+// writers only (under g_hosts_mutex)
+static void host_status_put( const std::string & site, uint32_t h, const HOST_STATE & st )
 {
-    GostSSL_Worker * w = NULL;
+    HOST_TABLE * t = g_hosts.load( std::memory_order_relaxed );
 
-    if( action == WDB_NEW )
+    if( t )
     {
-        w = new GostSSL_Worker();
-        w->h = msspi_open( w, (msspi_read_cb)gostssl_read_cb, (msspi_write_cb)gostssl_write_cb );
+        HOST_ENTRY * e = host_table_find( t, site, h );
 
-        if( !w->h )
+        if( e )
         {
-            delete w;
-            return NULL;
+            e->fails = st.fails;
+            e->probes = st.probes;
+            e->window = st.window;
+            e->expires.store( st.expires, std::memory_order_relaxed );
+            e->status.store( st.status, std::memory_order_release );
+            return;
         }
-
-        msspi_set_cert_cb( w->h, (msspi_cert_cb)gostssl_cert_cb );
-        w->s = s;
-
-        if( s->tlsext_hostname )
-            msspi_set_hostname( w->h, s->tlsext_hostname );
-        if( cachestring )
-            msspi_set_cachestring( w->h, cachestring );
-        if( s->alpn_client_proto_list && s->alpn_client_proto_list_len )
-            msspi_set_alpn( w->h, s->alpn_client_proto_list, s->alpn_client_proto_list_len );
-
-        w->host_string = s->tlsext_hostname ? s->tlsext_hostname : "*";
-        w->host_string += ":";
-        w->host_string += cachestring ? cachestring : "*";
-
-        w->host_status = host_status_get( w->host_string );
     }
 
-    std::unique_lock<std::recursive_mutex> lck( gmutex );
+    if( !t )
+        t = host_table_rebuild( NULL );
 
-    WORKERS_DB::iterator lb = workers_db.lower_bound( s );
+    if( t->count >= t->capacity )
+        host_table_evict( t );
 
-    if( lb != workers_db.end() && !( workers_db.key_comp()( s, lb->first ) ) )
+    // too many tombstones or no room for the key
+    if( t->used >= ( t->mask + 1 ) * 3 / 4 ||
+        t->arena_used + site.size() > t->arena_size )
     {
-        GostSSL_Worker * w_found = lb->second;
+        t = host_table_rebuild( t );
 
-        if( action == WDB_NEW )
-        {
-            delete w_found;
-            lb->second = w;
-            return w;
-        }
-        else if( action == WDB_FREE )
+        while( t->arena_used + site.size() > t->arena_size && t->count )
         {
-            if( w_found->host_status >= GOSTSSL_HOST_PROBING &&
-                w_found->host_status <= GOSTSSL_HOST_PROBING_END )
-            {
-                GOSTSSL_HOST_STATUS status;
-
-                if( w_found->host_status == GOSTSSL_HOST_PROBING_END )
-                    status = GOSTSSL_HOST_AUTO;
-                else
-                    status = (GOSTSSL_HOST_STATUS)( (int)w_found->host_status + 1 );
-
-                host_status_set( w_found->host_string, status );
-            }
-
-            delete w_found;
-            workers_db.erase( lb );
-            return NULL;
+            host_table_evict( t );
+            t = host_table_rebuild( t );
         }
-
-        return w_found;
     }
 
-    if( action == WDB_NEW )
-        workers_db.insert( lb, WORKERS_DB::value_type( s, w ) );
-
-    return w;
+    host_table_put( t, site.data(), site.size(), h, st, 1 );
 }
 
-int gostssl_tls_gost_required( SSL * s )
+static void host_status_load( const std::string & site, const HOST_STATE & st )
 {
-    GostSSL_Worker * w = workers_api( s, WDB_SEARCH );
-
-    if( w && 
-        ( s->s3->hs->new_cipher == tlsgost2001 || s->s3->hs->new_cipher == tlsgost2012 ) )
-    {
-        bssls->ERR_clear_error();
-        bssls->ERR_put_error( ERR_LIB_SSL, 0, SSL_R_TLS_GOST_REQUIRED, __FILE__, __LINE__ );
-        host_status_set( w->host_string, GOSTSSL_HOST_PROBING );
-        return 1;
-    }
-
-    return 0;
-}
+    if( site.size() > GOSTSSL_HOST_KEY_MAX )
+        return;
 
-static int msspi_to_ssl_version( DWORD dwProtocol )
-{
-    switch( dwProtocol )
-    {
-        case 0x00000301:
-        case 0x00000040 /*SP_PROT_TLS1_SERVER*/:
-        case 0x00000080 /*SP_PROT_TLS1_CLIENT*/:
-            return TLS1_VERSION;
+    std::unique_lock<std::mutex> lck( g_hosts_mutex );
 
-        case 0x00000302:
-        case 0x00000100 /*SP_PROT_TLS1_1_SERVER*/:
-        case 0x00000200 /*SP_PROT_TLS1_1_CLIENT*/:
-            return TLS1_1_VERSION;
+    uint32_t h = host_hash( site.data(), site.size() );
+    HOST_TABLE * t = g_hosts.load( std::memory_order_relaxed );
 
-        case 0x00000303:
-        case 0x00000400 /*SP_PROT_TLS1_2_SERVER*/:
-        case 0x00000800 /*SP_PROT_TLS1_2_CLIENT*/:
-            return TLS1_2_VERSION;
+    // already learned by another thread
+    if( t && host_table_find( t, site, h ) )
+        return;
 
-        default:
-            return SSL3_VERSION;
-    }
+    host_status_put( site, h, st );
 }
 
-static int msspi_to_ssl_state_ret( int state, SSL * s, int ret )
+typedef enum
 {
-    if( state & MSSPI_ERROR )
-        s->rwstate = SSL_NOTHING;
-    else if( state & MSSPI_SENT_SHUTDOWN && state & MSSPI_RECEIVED_SHUTDOWN )
-        s->rwstate = SSL_NOTHING;
-    else if( state & MSSPI_X509_LOOKUP )
-        s->rwstate = SSL_X509_LOOKUP;
-    else if( state & MSSPI_WRITING )
-    {
-        if( state & MSSPI_LAST_PROC_WRITE )
-            s->rwstate = SSL_WRITING;
-        else if( state & MSSPI_READING )
-            s->rwstate = SSL_READING;
-        else
-            s->rwstate = SSL_WRITING;
-    }
-    else if( state & MSSPI_READING )
-        s->rwstate = SSL_READING;
-    else
-        s->rwstate = SSL_NOTHING;
-
-    return ret;
+    HOST_EVENT_GOST_REQUIRED,
+    HOST_EVENT_HANDSHAKE_OK,
+    HOST_EVENT_HANDSHAKE_FAILED,
 }
+HOST_EVENT;
 
-int gostssl_read( SSL * s, void * buf, int len, int * is_gost )
+static void host_status_count( uint8_t from, uint8_t to )
 {
-    GostSSL_Worker * w = workers_api( s, WDB_SEARCH );
-
-    // fallback
-    if( !w || w->host_status != GOSTSSL_HOST_YES )
+    switch( from )
     {
-        *is_gost = FALSE;
-        return 1;
+        case GOSTSSL_HOST_AUTO:
+            if( to == GOSTSSL_HOST_PROBING ) GOSTSSL_COUNT( host_auto_to_probing );
+            else if( to == GOSTSSL_HOST_NO ) GOSTSSL_COUNT( host_auto_to_no );
+            break;
+        case GOSTSSL_HOST_PROBING:
+            if( to == GOSTSSL_HOST_PROBING ) GOSTSSL_COUNT( host_probing_to_probing );
+            else if( to == GOSTSSL_HOST_YES ) GOSTSSL_COUNT( host_probing_to_yes );
+            else if( to == GOSTSSL_HOST_NO ) GOSTSSL_COUNT( host_probing_to_no );
+            break;
+        case GOSTSSL_HOST_YES:
+            if( to == GOSTSSL_HOST_YES ) GOSTSSL_COUNT( host_yes_to_yes );
+            else if( to == GOSTSSL_HOST_AUTO ) GOSTSSL_COUNT( host_yes_to_auto );
+            break;
+        case GOSTSSL_HOST_NO:
+            if( to == GOSTSSL_HOST_AUTO ) GOSTSSL_COUNT( host_no_to_auto );
+            else if( to == GOSTSSL_HOST_PROBING ) GOSTSSL_COUNT( host_no_to_probing );
+            else if( to == GOSTSSL_HOST_YES ) GOSTSSL_COUNT( host_no_to_yes );
+            break;
     }
-
-    *is_gost = TRUE;
-
-    int ret = msspi_read( w->h, buf, len );
-    return msspi_to_ssl_state_ret( msspi_state( w->h ), s, ret );
 }
 
-int gostssl_write( SSL * s, const void * buf, int len, int * is_gost )
+// host decisions state machine
+//
+// AUTO    -> PROBING  server picked a GOST cipher in boringssl
+// PROBING -> YES      msspi handshake completed
+// PROBING -> PROBING  msspi handshake failed, retry
+// PROBING -> NO       msspi handshake failed |g_probe_attempts| times,
+//                     NO expires after |g_no_ttl| doubled on each round
+// YES     -> YES      msspi handshake completed, expiry is renewed
+// YES     -> AUTO     msspi handshake failed after expiry or too often
+// NO      -> AUTO     expired, boringssl is tried again
+// any     -> NO       more than |g_probes_per_hour| probes in an hour
+static GOSTSSL_HOST_STATUS host_status_event( const std::string & site, HOST_EVENT event )
 {
-    GostSSL_Worker * w = workers_api( s, WDB_SEARCH );
-
-    // fallback
-    if( !w || w->host_status != GOSTSSL_HOST_YES )
-    {
-        *is_gost = FALSE;
-        return 1;
-    }
+    if( site.size() > GOSTSSL_HOST_KEY_MAX )
+        return GOSTSSL_HOST_AUTO;
 
-    *is_gost = TRUE;
+    std::unique_lock<std::mutex> lck( g_hosts_mutex );
 
-    int ret = msspi_write( w->h, buf, len );
-    return msspi_to_ssl_state_ret( msspi_state( w->h ), s, ret );
-}
+    uint32_t h = host_hash( site.data(), site.size() );
+    uint32_t now = (uint32_t)time( NULL );
+    HOST_TABLE * t = g_hosts.load( std::memory_order_relaxed );
+    HOST_ENTRY * e = t ? host_table_find( t, site, h ) : NULL;
+    HOST_STATE st = { GOSTSSL_HOST_AUTO, 0, 0, 0, now };
 
-void gostssl_cachestring( SSL * s, const char * cachestring )
-{
-    workers_api( s, WDB_NEW, cachestring );
-}
+    if( e )
+        host_entry_state( e, st );
 
-int gostssl_connect( SSL * s, int * is_gost )
-{
-    GostSSL_Worker * w = workers_api( s, WDB_SEARCH );
+    uint8_t from = st.status;
+    bool is_expired = st.expires && now >= st.expires;
 
-    // fallback
-    if( !w || w->host_status == GOSTSSL_HOST_AUTO || w->host_status == GOSTSSL_HOST_NO )
+    if( from == GOSTSSL_HOST_NO && is_expired )
     {
-        *is_gost = FALSE;
-        return 1;
+        host_status_count( GOSTSSL_HOST_NO, GOSTSSL_HOST_AUTO );
+        from = st.status = GOSTSSL_HOST_AUTO;
+        st.expires = 0;
     }
 
-    *is_gost = TRUE;
-
-    if( s->s3->hs->state == SSL_ST_INIT )
-        s->s3->hs->state = SSL_ST_CONNECT;
-
-    int ret = msspi_connect( w->h );
+    if( now - st.window >= 3600 )
+    {
+        st.window = now;
+        st.probes = 0;
+    }
 
-    if( ret == 1 )
+    switch( event )
     {
-        s->rwstate = SSL_NOTHING;
+        case HOST_EVENT_GOST_REQUIRED:
+        {
+            if( st.status != GOSTSSL_HOST_AUTO && st.status != GOSTSSL_HOST_PROBING )
+                return (GOSTSSL_HOST_STATUS)st.status;
 
-        // skip
-        if( s->s3->established_session &&
-            s->s3->established_session->cipher &&
-            s->s3->aead_write_ctx &&
-            s->s3->aead_write_ctx->cipher )
+            st.status = GOSTSSL_HOST_PROBING;
+            break;
+        }
+
+        case HOST_EVENT_HANDSHAKE_OK:
         {
-            s->s3->hs->state = SSL_ST_OK;
-            return 1;
+            st.status = GOSTSSL_HOST_YES;
+            st.fails = 0;
+            st.expires = g_yes_ttl ? now + g_yes_ttl : 0;
+            break;
         }
 
+        case HOST_EVENT_HANDSHAKE_FAILED:
         {
-            const char * alpn = msspi_get_alpn( w->h );
-            size_t alpn_len;
+            if( st.status == GOSTSSL_HOST_PROBING )
+            {
+                if( st.fails < 0xFF )
+                    st.fails++;
 
-            if( s->s3->alpn_selected )
-                bssls->BORINGSSL_free( s->s3->alpn_selected );
+                if( st.fails >= g_probe_attempts )
+                {
+                    unsigned ttl = g_no_ttl;
+                    unsigned round = st.fails - g_probe_attempts;
 
-            if( !alpn )
-                alpn = "http/1.1";
+                    while( round-- && ttl < g_no_ttl_max )
+                        ttl *= 2;
 
-            alpn_len = strlen( alpn );
+                    if( ttl > g_no_ttl_max )
+                        ttl = g_no_ttl_max;
 
-            s->s3->alpn_selected = (uint8_t *)bssls->BORINGSSL_malloc( alpn_len );
+                    st.status = GOSTSSL_HOST_NO;
+                    st.expires = now + ttl;
+                }
+            }
+            else if( st.status == GOSTSSL_HOST_YES )
+            {
+                if( st.fails < 0xFF )
+                    st.fails++;
 
-            if( !s->s3->alpn_selected )
-                return 0;
+                if( is_expired || st.fails >= g_probe_attempts )
+                {
+                    st.status = GOSTSSL_HOST_AUTO;
+                    st.fails = 0;
+                    st.expires = 0;
+                }
+            }
+            else
+            {
+                return (GOSTSSL_HOST_STATUS)st.status;
+            }
 
-            memcpy( s->s3->alpn_selected, alpn, alpn_len );
-            s->s3->alpn_selected_len = alpn_len;
+            break;
         }
+    }
 
-        // cipher
+    // every probe costs a round trip
+    if( event != HOST_EVENT_HANDSHAKE_OK )
+    {
+        GOSTSSL_COUNT( host_probes );
+
+        if( st.probes < 0xFFFF )
+            st.probes++;
+
+        if( g_probes_per_hour && st.probes > g_probes_per_hour && st.status != GOSTSSL_HOST_YES )
         {
-            PSecPkgContext_CipherInfo cipher_info = msspi_get_cipherinfo( w->h );
+            GOSTSSL_COUNT( host_probes_limited );
+            st.status = GOSTSSL_HOST_NO;
+            st.expires = st.window + 3600;
+        }
+    }
 
-            if( !cipher_info )
-                return 0;
+    host_status_count( from, st.status );
+    host_status_put( site, h, st );
 
-            const SSL_CIPHER * cipher = bssls->SSL_get_cipher_by_value( (uint16_t)cipher_info->dwCipherSuite );
+    if( from == GOSTSSL_HOST_YES || from == GOSTSSL_HOST_NO ||
+        st.status == GOSTSSL_HOST_YES || st.status == GOSTSSL_HOST_NO )
+        host_store_set( site, st );
 
-            if( !cipher )
-                return 0;
+    return (GOSTSSL_HOST_STATUS)st.status;
+}
 
-            s->version = (uint16_t)msspi_to_ssl_version( cipher_info->dwProtocol );
-            s->s3->have_version = 1;
+#if defined( _WIN32 ) && defined( W_SITES )
 
-            // mimic boringssl
-            if( bssls->ssl_get_new_session( s->s3->hs, 0 ) <= 0 )
-                return 0;
+#define REGISTRY_TREE01 "Software"
+#define REGISTRY_TREE02 "Crypto Pro"
+#define REGISTRY_TREE03 "gostssl"
+#define REGISTRY_CHROME_SITES "_sites"
 
-            s->s3->established_session = s->s3->hs->new_session;
-            s->s3->hs->new_session = NULL;
+static HKEY hKeyChromeRegistryDir = 0;
 
-            s->s3->established_session->ssl_version = s->version;
-            s->s3->established_session->cipher = cipher;
+VOID CloseChromeRegistryDir()
+{
+    if( hKeyChromeRegistryDir )
+    {
+        RegCloseKey( hKeyChromeRegistryDir );
+        hKeyChromeRegistryDir = 0;
+    }
+}
 
-            {
-                if( s->s3->aead_write_ctx )
-                    bssls->BORINGSSL_free( s->s3->aead_write_ctx );
+BOOL OpenChromeRegistryDir( CHAR * szDir, BOOL is_write )
+{
+    HKEY hKey = 0;
+    HKEY hKeyChild = 0;
+    REGSAM RW = KEY_READ | ( is_write ? KEY_WRITE : 0 );
+    CHAR szChromeRegistryDir[MAX_PATH] = { 0 };
+    int i;
 
-                s->s3->aead_write_ctx = (SSL_AEAD_CTX *)bssls->BORINGSSL_malloc( sizeof( ssl_aead_ctx_st ) );
+    CloseChromeRegistryDir();
 
-                if( !s->s3->aead_write_ctx )
-                    return 0;
+    if( -1 == sprintf_s( szChromeRegistryDir, _countof( szChromeRegistryDir ), REGISTRY_TREE01 "\\" REGISTRY_TREE02 "\\" REGISTRY_TREE03 "\\%s", szDir ) )
+        return FALSE;
 
-                memset( s->s3->aead_write_ctx, 0, sizeof( ssl_aead_ctx_st ) );
-                s->s3->aead_write_ctx->cipher = cipher;
-            }
+    for( i = 0; i < 5; i++ )
+    {
+        if( hKey )
+        {
+            RegCloseKey( hKey );
+            hKey = 0;
         }
 
-        // mimic ssl3_get_server_certificate
+        if( hKeyChild )
         {
-            STACK_OF( CRYPTO_BUFFER ) * sk;
-            sk = ( STACK_OF( CRYPTO_BUFFER ) * )bssls->sk_new_null();
+            RegCloseKey( hKeyChild );
+            hKeyChild = 0;
+        }
+
+        if( hKeyChromeRegistryDir )
+            return TRUE;
+
+        if( RegOpenKeyExA( HKEY_CURRENT_USER, szChromeRegistryDir, 0, RW, &hKey ) )
+        {
+            if( !is_write )
+                break;
+
+            if( RegOpenKeyExA( HKEY_CURRENT_USER, REGISTRY_TREE01 "\\" REGISTRY_TREE02 "\\" REGISTRY_TREE03, 0, RW, &hKey ) )
+            {
+                if( RegOpenKeyExA( HKEY_CURRENT_USER, REGISTRY_TREE01 "\\" REGISTRY_TREE02, 0, RW, &hKey ) )
+                {
+                    if( RegOpenKeyExA( HKEY_CURRENT_USER, REGISTRY_TREE01, 0, RW, &hKey ) )
+                        break;
+
+                    if( RegCreateKeyA( hKey, REGISTRY_TREE02, &hKeyChild ) )
+                        break;
+
+                    continue;
+                }
+
+                if( RegCreateKeyA( hKey, REGISTRY_TREE03, &hKeyChild ) )
+                    break;
+
+                continue;
+            }
+
+            if( RegCreateKeyA( hKey, szDir, &hKeyChild ) )
+                break;
+
+            continue;
+        }
+
+        hKeyChromeRegistryDir = hKey;
+        hKey = 0;
+    }
+
+    return FALSE;
+}
+
+// registry sites are imported into the host store once
+static void host_store_import()
+{
+    if( !OpenChromeRegistryDir( (CHAR *)REGISTRY_CHROME_SITES, FALSE ) )
+        return;
+
+    for( DWORD i = 0;; i++ )
+    {
+        CHAR szSite[MAX_PATH];
+        DWORD dwSiteLen = _countof( szSite );
+        DWORD dwType;
+        DWORD dwStatus;
+        DWORD dwLen = sizeof( dwStatus );
+
+        LONG status = RegEnumValueA( hKeyChromeRegistryDir, i, szSite, &dwSiteLen, NULL, &dwType, (BYTE *)&dwStatus, &dwLen );
+
+        if( status == ERROR_MORE_DATA )
+            continue;
+
+        if( status != ERROR_SUCCESS )
+            break;
+
+        if( dwType == REG_DWORD && ( dwStatus == GOSTSSL_HOST_YES || dwStatus == GOSTSSL_HOST_NO ) )
+        {
+            // legacy decisions never expire
+            HOST_STATE st = { (uint8_t)dwStatus, 0, 0, 0, 0 };
+            host_store_set( std::string( szSite, dwSiteLen ), st );
+        }
+    }
+
+    CloseChromeRegistryDir();
+}
+
+#endif
+
+// host store
+//
+// learned YES/NO statuses persist across restarts in a memory-mapped file,
+// slots are addressed by key hash and committed by writing the hash last,
+// a slot with a wrong check value (torn by a crash) is treated as empty
+
+#define GOSTSSL_STORE_MAGIC "GOSTSSLS"
+#define GOSTSSL_STORE_VERSION 2
+#define GOSTSSL_STORE_SLOTS 4096
+#define GOSTSSL_STORE_PROBES 8
+#define GOSTSSL_STORE_KEY_MAX 236
+
+struct HOST_STORE_HEADER
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t slot_size;
+    uint32_t slot_count;
+    uint32_t reserved[11];
+};
+
+struct HOST_STORE_SLOT
+{
+    uint32_t hash;
+    uint32_t check;
+    uint32_t updated;
+    uint32_t expires;
+    uint8_t status;
+    uint8_t key_len;
+    uint8_t fails;
+    uint8_t reserved;
+    char key[GOSTSSL_STORE_KEY_MAX];
+};
+
+static_assert( sizeof( HOST_STORE_HEADER ) == 64, "HOST_STORE_HEADER size" );
+static_assert( sizeof( HOST_STORE_SLOT ) == 256, "HOST_STORE_SLOT size" );
+
+static HOST_STORE_HEADER * g_store = NULL;
+static HOST_STORE_SLOT * g_store_slots = NULL;
+
+static uint32_t host_store_check( const HOST_STORE_SLOT * slot )
+{
+    uint32_t h = slot->hash ^ ( slot->updated * 16777619u );
+
+    h = ( h ^ slot->status ) * 16777619u;
+    h = ( h ^ slot->key_len ) * 16777619u;
+
+    for( size_t i = 0; i < slot->key_len && i < GOSTSSL_STORE_KEY_MAX; i++ )
+        h = ( h ^ (uint8_t)slot->key[i] ) * 16777619u;
+
+    return h;
+}
+
+static bool host_store_path( std::string & path )
+{
+    const char * env = getenv( "GOSTSSL_STORE" );
+
+    if( env && *env )
+    {
+        path = env;
+        return true;
+    }
+
+#ifdef _WIN32
+    env = getenv( "LOCALAPPDATA" );
+
+    if( !env || !*env )
+        return false;
+
+    path = env;
+    path += "\\chromium-gost";
+    CreateDirectoryA( path.c_str(), NULL );
+    path += "\\gostssl_hosts";
+#else
+    env = getenv( "XDG_CONFIG_HOME" );
+
+    if( env && *env )
+    {
+        path = env;
+    }
+    else
+    {
+        env = getenv( "HOME" );
+
+        if( !env || !*env )
+            return false;
+
+        path = env;
+        path += "/.config";
+        mkdir( path.c_str(), 0700 );
+    }
+
+    path += "/chromium-gost";
+    mkdir( path.c_str(), 0700 );
+    path += "/gostssl_hosts";
+#endif
+
+    return true;
+}
+
+static void host_store_open()
+{
+    std::string path;
+    size_t size = sizeof( HOST_STORE_HEADER ) + GOSTSSL_STORE_SLOTS * sizeof( HOST_STORE_SLOT );
+    bool is_new = false;
+    void * map;
+
+    if( !host_store_path( path ) )
+        return;
+
+#ifdef _WIN32
+    HANDLE hFile = CreateFileA( path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL );
+
+    if( hFile == INVALID_HANDLE_VALUE )
+        return;
+
+    if( GetFileSize( hFile, NULL ) != size )
+    {
+        SetFilePointer( hFile, 0, NULL, FILE_BEGIN );
+        SetEndOfFile( hFile );
+        is_new = true;
+    }
+
+    HANDLE hMap = CreateFileMappingA( hFile, NULL, PAGE_READWRITE, 0, (DWORD)size, NULL );
+    CloseHandle( hFile );
+
+    if( !hMap )
+        return;
+
+    map = MapViewOfFile( hMap, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, size );
+    CloseHandle( hMap );
+
+    if( !map )
+        return;
+#else
+    int fd = open( path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600 );
+
+    if( fd == -1 )
+        return;
+
+    struct stat st;
+
+    if( fstat( fd, &st ) || (size_t)st.st_size != size )
+    {
+        if( ftruncate( fd, 0 ) || ftruncate( fd, (off_t)size ) )
+        {
+            close( fd );
+            return;
+        }
+
+        is_new = true;
+    }
+
+    map = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    close( fd );
+
+    if( map == MAP_FAILED )
+        return;
+#endif
+
+    HOST_STORE_HEADER * header = (HOST_STORE_HEADER *)map;
+
+    if( is_new ||
+        memcmp( header->magic, GOSTSSL_STORE_MAGIC, sizeof( header->magic ) ) ||
+        header->version != GOSTSSL_STORE_VERSION ||
+        header->slot_size != sizeof( HOST_STORE_SLOT ) ||
+        header->slot_count != GOSTSSL_STORE_SLOTS )
+    {
+        memset( map, 0, size );
+        header->version = GOSTSSL_STORE_VERSION;
+        header->slot_size = sizeof( HOST_STORE_SLOT );
+        header->slot_count = GOSTSSL_STORE_SLOTS;
+        memcpy( header->magic, GOSTSSL_STORE_MAGIC, sizeof( header->magic ) );
+        is_new = true;
+    }
+
+    g_store_slots = (HOST_STORE_SLOT *)( header + 1 );
+    g_store = header;
+
+#if defined( _WIN32 ) && defined( W_SITES )
+    if( is_new )
+        host_store_import();
+#endif
+}
+
+static HOST_STORE_SLOT * host_store_find( const std::string & site, uint32_t h, HOST_STORE_SLOT * copy )
+{
+    for( uint32_t n = 0; n < GOSTSSL_STORE_PROBES; n++ )
+    {
+        HOST_STORE_SLOT * slot = &g_store_slots[( h + n ) & ( GOSTSSL_STORE_SLOTS - 1 )];
+
+        if( slot->hash != h )
+            continue;
+
+        memcpy( copy, slot, sizeof( *copy ) );
+
+        if( copy->hash == h &&
+            copy->check == host_store_check( copy ) &&
+            copy->key_len == site.size() &&
+            0 == memcmp( copy->key, site.data(), site.size() ) )
+            return slot;
+    }
+
+    return NULL;
+}
+
+static bool host_store_get( const std::string & site, HOST_STATE & st )
+{
+    HOST_STORE_SLOT copy;
+
+    if( !g_store || site.size() > GOSTSSL_STORE_KEY_MAX )
+        return false;
+
+    if( !host_store_find( site, host_hash( site.data(), site.size() ), &copy ) )
+        return false;
+
+    // AUTO is kept once learned, it overrides the preload list
+    if( copy.status != GOSTSSL_HOST_AUTO && copy.status != GOSTSSL_HOST_YES && copy.status != GOSTSSL_HOST_NO )
+        return false;
+
+    st.status = copy.status;
+    st.fails = copy.fails;
+    st.probes = 0;
+    st.expires = copy.expires;
+    st.window = 0;
+
+    return true;
+}
+
+// writers only (under g_hosts_mutex)
+static void host_store_set( const std::string & site, const HOST_STATE & st )
+{
+    HOST_STORE_SLOT copy;
+
+    if( !g_store || site.size() > GOSTSSL_STORE_KEY_MAX )
+        return;
+
+    uint32_t h = host_hash( site.data(), site.size() );
+    HOST_STORE_SLOT * slot = host_store_find( site, h, &copy );
+
+    if( slot &&
+        copy.status == st.status &&
+        copy.fails == st.fails &&
+        copy.expires == st.expires )
+        return;
+
+    if( !slot && st.status == GOSTSSL_HOST_PROBING )
+        return;
+
+    if( !slot )
+    {
+        // first free or torn slot, else replace the home slot
+        slot = &g_store_slots[h & ( GOSTSSL_STORE_SLOTS - 1 )];
+
+        for( uint32_t n = 0; n < GOSTSSL_STORE_PROBES; n++ )
+        {
+            HOST_STORE_SLOT * probe = &g_store_slots[( h + n ) & ( GOSTSSL_STORE_SLOTS - 1 )];
+
+            if( !probe->hash || probe->check != host_store_check( probe ) )
+            {
+                slot = probe;
+                break;
+            }
+        }
+    }
+
+    memset( &copy, 0, sizeof( copy ) );
+    copy.hash = h;
+    copy.updated = (uint32_t)time( NULL );
+    copy.expires = st.expires;
+    copy.status = st.status;
+    copy.fails = st.fails;
+    copy.key_len = (uint8_t)site.size();
+    memcpy( copy.key, site.data(), site.size() );
+    copy.check = host_store_check( &copy );
+
+    // invalidate, fill, commit
+    slot->hash = 0;
+    std::atomic_thread_fence( std::memory_order_release );
+    memcpy( (char *)slot + sizeof( slot->hash ), (char *)&copy + sizeof( copy.hash ), sizeof( copy ) - sizeof( copy.hash ) );
+    std::atomic_thread_fence( std::memory_order_release );
+    slot->hash = copy.hash;
+}
+
+// preload list
+//
+// hosts known to require GOST, compiled from gostssl_preload.txt
+// into a perfect hash, plus operator entries from GOSTSSL_PRELOAD,
+// suffix entries are stored without the leading dot and flagged
+
+struct PRELOAD_ENTRY
+{
+    const char * key;
+    uint32_t len;
+    uint32_t is_suffix;
+};
+
+static constexpr uint32_t preload_hash( const char * key, size_t len, uint32_t h )
+{
+    return len ? preload_hash( key + 1, len - 1, ( h ^ (uint8_t)*key ) * 16777619u ) : h;
+}
+
+#include "gostssl_preload.h"
+
+static std::vector< std::pair< std::string, bool > > g_preload_extra;
+
+typedef std::pair< const char *, size_t > PRELOAD_KEY;
+
+static bool preload_extra_less( const std::pair< std::string, bool > & entry, const PRELOAD_KEY & key )
+{
+    return entry.first.compare( 0, std::string::npos, key.first, key.second ) < 0;
+}
+
+static void preload_init()
+{
+    const char * path = getenv( "GOSTSSL_PRELOAD" );
+
+    if( !path || !*path )
+        return;
+
+    FILE * f = fopen( path, "r" );
+
+    if( !f )
+        return;
+
+    char line[512];
+
+    while( fgets( line, sizeof( line ), f ) )
+    {
+        std::string key;
+        bool is_suffix = false;
+
+        for( char * p = line; *p && *p != '#'; p++ )
+        {
+            char c = *p;
+
+            if( c == ' ' || c == '\t' || c == '\r' || c == '\n' )
+                continue;
+
+            if( c >= 'A' && c <= 'Z' )
+                c = c - 'A' + 'a';
+
+            if( c == '.' && key.empty() )
+            {
+                is_suffix = true;
+                continue;
+            }
+
+            key += c;
+        }
+
+        if( key.empty() || key.size() > 253 )
+            continue;
+
+        g_preload_extra.push_back( std::make_pair( key, is_suffix ) );
+    }
+
+    fclose( f );
+
+    // a suffix entry covers the exact one
+    std::sort( g_preload_extra.begin(), g_preload_extra.end() );
+
+    size_t n = 0;
+
+    for( size_t i = 0; i < g_preload_extra.size(); i++ )
+    {
+        if( n && g_preload_extra[n - 1].first == g_preload_extra[i].first )
+            g_preload_extra[n - 1].second = g_preload_extra[i].second;
+        else
+            g_preload_extra[n++] = g_preload_extra[i];
+    }
+
+    g_preload_extra.resize( n );
+}
+
+static bool preload_find( const char * key, size_t len, bool is_parent )
+{
+    uint32_t b = preload_hash( key, len, 2166136261u ) % GOSTSSL_PRELOAD_BUCKETS;
+    const PRELOAD_ENTRY * e = &g_preload[preload_hash( key, len, g_preload_seeds[b] ) % GOSTSSL_PRELOAD_SLOTS];
+
+    if( e->len == len && 0 == memcmp( e->key, key, len ) && ( !is_parent || e->is_suffix ) )
+        return true;
+
+    if( g_preload_extra.empty() )
+        return false;
+
+    auto it = std::lower_bound( g_preload_extra.begin(), g_preload_extra.end(), PRELOAD_KEY( key, len ), preload_extra_less );
+
+    return it != g_preload_extra.end() && 0 == it->first.compare( 0, std::string::npos, key, len ) && ( !is_parent || it->second );
+}
+
+// probes the host and each of its parent domains
+static bool host_preloaded( const std::string & site )
+{
+    size_t len = site.find( ':' );
+
+    if( len == std::string::npos )
+        len = site.size();
+
+    // nothing compiled in and no operator list, the usual case for now
+    if( !GOSTSSL_PRELOAD_COUNT && g_preload_extra.empty() )
+        return false;
+
+    const char * host = site.data();
+
+    for( size_t i = 0; i < len; )
+    {
+        if( preload_find( host + i, len - i, i != 0 ) )
+            return true;
+
+        const char * dot = (const char *)memchr( host + i, '.', len - i );
+
+        if( !dot )
+            break;
+
+        i = dot - host + 1;
+    }
+
+    return false;
+}
+
+// domain-level keys
+//
+// exact keys are "hostname:cachestring", what is learned there is
+// propagated (YES only) to the hostname-only key "hostname" and to the
+// registrable domain key ".domain", new exact keys fall back to them;
+// the registrable domain comes from Chromium's public suffix list with
+// private registries included, so tenants of a shared suffix
+// (*.github.io) never share a key, a hostname without one (an IP
+// address, a suffix itself) only falls back to its hostname-only key
+
+static bool host_parents( const std::string & site, const std::string & registrable, std::string & host, std::string & domain )
+{
+    size_t len = site.find( ':' );
+
+    if( len == std::string::npos || !len || site.compare( 0, len, "*" ) == 0 )
+        return false;
+
+    host.assign( site, 0, len );
+    domain.clear();
+
+    // the registrable domain must be the hostname or a parent of it
+    if( !registrable.empty() && registrable.size() <= len &&
+        0 == host.compare( len - registrable.size(), registrable.size(), registrable ) &&
+        ( registrable.size() == len || host[len - registrable.size() - 1] == '.' ) )
+    {
+        domain = ".";
+        domain += registrable;
+    }
+
+    return true;
+}
+
+// table, then store
+static bool host_status_find( const std::string & key, GOSTSSL_HOST_STATUS & status )
+{
+    bool is_found = false;
+
+    if( g_hosts.load( std::memory_order_relaxed ) )
+    {
+        unsigned epoch = rcu_read_lock();
+        HOST_TABLE * t = g_hosts.load( std::memory_order_acquire );
+
+        if( t )
+        {
+            HOST_ENTRY * e = host_table_find( t, key, host_hash( key.data(), key.size() ) );
+
+            if( e )
+            {
+                status = (GOSTSSL_HOST_STATUS)e->status.load( std::memory_order_acquire );
+
+                // expired NO is lazily turned into AUTO by the next event
+                if( status == GOSTSSL_HOST_NO )
+                {
+                    uint32_t expires = e->expires.load( std::memory_order_relaxed );
+
+                    if( expires && (uint32_t)time( NULL ) >= expires )
+                        status = GOSTSSL_HOST_AUTO;
+                }
+
+                if( !e->ref.load( std::memory_order_relaxed ) )
+                    e->ref.store( 1, std::memory_order_relaxed );
+
+                is_found = true;
+            }
+        }
+
+        rcu_read_unlock( epoch );
+    }
+
+    if( is_found )
+        return true;
+
+    HOST_STATE st;
+
+    if( !host_store_get( key, st ) )
+        return false;
+
+    host_status_load( key, st );
+
+    status = (GOSTSSL_HOST_STATUS)st.status;
+
+    if( status == GOSTSSL_HOST_NO && st.expires && (uint32_t)time( NULL ) >= st.expires )
+        status = GOSTSSL_HOST_AUTO;
+
+    return true;
+}
+
+// |registrable| is the registrable domain of the hostname or empty,
+// |inferred| receives the key a YES was inferred from
+GOSTSSL_HOST_STATUS host_status_get( const std::string & site, const std::string & registrable = std::string(), std::string * inferred = NULL )
+{
+    GOSTSSL_HOST_STATUS status;
+
+    // learned decisions win over the preload list
+    if( host_status_find( site, status ) )
+        return status;
+
+    if( host_preloaded( site ) )
+    {
+        HOST_STATE st = { GOSTSSL_HOST_YES, 0, 0, 0, 0 };
+        host_status_load( site, st );
+        return GOSTSSL_HOST_YES;
+    }
+
+    // kept per thread, binding a connection allocates nothing
+    static thread_local std::string host;
+    static thread_local std::string domain;
+
+    if( !host_parents( site, registrable, host, domain ) )
+        return GOSTSSL_HOST_AUTO;
+
+    const std::string * parents[] = { &host, &domain };
+
+    for( size_t i = 0; i < 2; i++ )
+    {
+        const std::string & key = *parents[i];
+
+        if( !key.empty() && host_status_find( key, status ) && status == GOSTSSL_HOST_YES )
+        {
+            GOSTSSL_COUNT( host_inferred );
+
+            if( inferred )
+                *inferred = key;
+
+            return GOSTSSL_HOST_YES;
+        }
+    }
+
+    return GOSTSSL_HOST_AUTO;
+}
+
+// a completed handshake teaches the hostname and its domain
+static void host_status_propagate( const std::string & site, const std::string & registrable )
+{
+    static thread_local std::string host;
+    static thread_local std::string domain;
+
+    if( !host_parents( site, registrable, host, domain ) )
+        return;
+
+    const std::string * parents[] = { &host, &domain };
+    uint32_t now = (uint32_t)time( NULL );
+
+    std::unique_lock<std::mutex> lck( g_hosts_mutex );
+
+    for( size_t i = 0; i < 2; i++ )
+    {
+        const std::string & key = *parents[i];
+
+        if( key.empty() || key.size() > GOSTSSL_HOST_KEY_MAX )
+            continue;
+
+        uint32_t h = host_hash( key.data(), key.size() );
+        HOST_TABLE * t = g_hosts.load( std::memory_order_relaxed );
+        HOST_ENTRY * e = t ? host_table_find( t, key, h ) : NULL;
+        HOST_STATE st = { GOSTSSL_HOST_YES, 0, 0, 0, now };
+
+        if( e )
+        {
+            host_entry_state( e, st );
+
+            // renew at half of the lifetime
+            if( st.status == GOSTSSL_HOST_YES && !st.fails &&
+                ( !st.expires || ( st.expires > now && st.expires - now > g_yes_ttl / 2 ) ) )
+                continue;
+        }
+
+        GOSTSSL_COUNT( host_propagated );
+
+        st.status = GOSTSSL_HOST_YES;
+        st.fails = 0;
+        st.expires = g_yes_ttl ? now + g_yes_ttl : 0;
+
+        host_status_put( key, h, st );
+        host_store_set( key, st );
+    }
+}
+
+// a YES inferred from |inferred| did not hold for |site|
+static void host_status_reject( const std::string & site, const std::string & inferred )
+{
+    GOSTSSL_COUNT( host_inferred_failed );
+
+    if( site.size() <= GOSTSSL_HOST_KEY_MAX )
+    {
+        std::unique_lock<std::mutex> lck( g_hosts_mutex );
+
+        // explicit AUTO stops further inference for this key
+        HOST_STATE st = { GOSTSSL_HOST_AUTO, 0, 0, 0, (uint32_t)time( NULL ) };
+        host_status_put( site, host_hash( site.data(), site.size() ), st );
+        host_store_set( site, st );
+    }
+
+    // the parent loses confidence the same way a YES host does
+    host_status_event( inferred, HOST_EVENT_HANDSHAKE_FAILED );
+}
+
+// session cache
+//
+// msspi keeps resumable sessions in the SSPI session cache, keyed by the
+// cachestring, and has no way to export or drop a single session, so
+// sessions are managed through the key: every entry hands out
+// "cachestring#generation", an expired, evicted or failed entry gets
+// a new generation and the SSPI session behind the old one is never
+// offered again, parallel connections to a host share one generation
+
+#define GOSTSSL_SESSIONS_MAX 1024
+#define GOSTSSL_SESSION_TTL ( 2 * 3600 )
+
+struct SESSION_ENTRY
+{
+    std::string site;
+    uint64_t generation;
+    uint32_t established;
+};
+
+typedef std::list< SESSION_ENTRY > SESSION_LRU;
+
+static std::mutex g_sessions_mutex;
+static SESSION_LRU g_sessions_lru;
+static std::map< std::string, SESSION_LRU::iterator > g_sessions;
+static uint64_t g_sessions_generation = 0;
+static unsigned g_sessions_max = GOSTSSL_SESSIONS_MAX;
+static unsigned g_session_ttl = GOSTSSL_SESSION_TTL;
+
+static void session_init()
+{
+    g_sessions_max = gostssl_config( "GOSTSSL_SESSIONS_MAX", GOSTSSL_SESSIONS_MAX );
+    g_session_ttl = gostssl_config( "GOSTSSL_SESSION_TTL", GOSTSSL_SESSION_TTL );
+}
+
+// |generation| to connect with, counted as a hit if it may resume
+static void session_get( const std::string & site, uint64_t & generation )
+{
+    bool is_resumable = false;
+
+    {
+        std::unique_lock<std::mutex> lck( g_sessions_mutex );
+
+        uint32_t now = (uint32_t)time( NULL );
+        auto it = g_sessions.find( site );
+
+        if( it != g_sessions.end() )
+        {
+            SESSION_ENTRY & e = *it->second;
+
+            if( e.established && g_session_ttl && now - e.established >= g_session_ttl )
+            {
+                GOSTSSL_COUNT( session_expired );
+                g_sessions_lru.erase( it->second );
+                g_sessions.erase( it );
+                it = g_sessions.end();
+            }
+        }
+
+        if( it != g_sessions.end() )
+        {
+            g_sessions_lru.splice( g_sessions_lru.begin(), g_sessions_lru, it->second );
+            generation = it->second->generation;
+            is_resumable = it->second->established != 0;
+        }
+        else if( g_sessions_max )
+        {
+            if( g_sessions.size() >= g_sessions_max )
+            {
+                GOSTSSL_COUNT( session_evictions );
+                g_sessions.erase( g_sessions_lru.back().site );
+                g_sessions_lru.pop_back();
+            }
+
+            SESSION_ENTRY e;
+            e.site = site;
+            e.generation = ++g_sessions_generation;
+            e.established = 0;
+
+            g_sessions_lru.push_front( e );
+            g_sessions[site] = g_sessions_lru.begin();
+            generation = e.generation;
+        }
+        else
+        {
+            generation = ++g_sessions_generation;
+        }
+    }
+
+    if( is_resumable )
+        GOSTSSL_COUNT( session_hits );
+    else
+        GOSTSSL_COUNT( session_misses );
+}
+
+// a handshake under |generation| left a session in SSPI
+static void session_put( const std::string & site, uint64_t generation )
+{
+    std::unique_lock<std::mutex> lck( g_sessions_mutex );
+
+    auto it = g_sessions.find( site );
+
+    if( it == g_sessions.end() || it->second->generation != generation || it->second->established )
+        return;
+
+    GOSTSSL_COUNT( session_stored );
+    it->second->established = (uint32_t)time( NULL );
+}
+
+// the session under |generation| failed, never offer it again
+static void session_drop( const std::string & site, uint64_t generation )
+{
+    std::unique_lock<std::mutex> lck( g_sessions_mutex );
+
+    auto it = g_sessions.find( site );
+
+    if( it == g_sessions.end() || it->second->generation != generation )
+        return;
+
+    GOSTSSL_COUNT( session_dropped );
+    g_sessions_lru.erase( it->second );
+    g_sessions.erase( it );
+}
+
+static bool verify_release( GostSSL_Worker * w );
+static bool handshake_release( GostSSL_Worker * w );
+
+// worker pool
+//
+// released workers are kept per thread and reused with their buffers,
+// so connection churn allocates nothing once warm; msspi handles cannot
+// be reset, they are opened only for connections that really go through
+// msspi (gostssl_connect for PROBING and YES hosts)
+
+#define GOSTSSL_WORKER_POOL 4
+#define GOSTSSL_HANDSHAKE_THREADS 2
+#define GOSTSSL_FALSE_START 1
+
+static unsigned g_worker_pool = GOSTSSL_WORKER_POOL;
+static unsigned g_handshake_threads = GOSTSSL_HANDSHAKE_THREADS;
+static bool g_false_start = GOSTSSL_FALSE_START != 0;
+
+struct WORKER_POOL
+{
+    ~WORKER_POOL()
+    {
+        for( size_t i = 0; i < free.size(); i++ )
+            delete free[i];
+    }
+
+    std::vector<GostSSL_Worker *> free;
+};
+
+static thread_local WORKER_POOL g_workers_pool;
+
+// msspi handles are closed by a background thread, releasing a security
+// context and its credentials in the CSP can take long and would stall
+// every other connection of the network thread, GOSTSSL_RECLAIM=0 closes
+// them in place
+
+static bool g_reclaim = true;
+static std::once_flag g_reclaim_once;
+// never destroyed, the thread may still wait on them at exit
+static std::mutex & g_reclaim_mutex = *new std::mutex;
+static std::condition_variable & g_reclaim_cv = *new std::condition_variable;
+static std::vector<MSSPI_HANDLE> & g_reclaim_queue = *new std::vector<MSSPI_HANDLE>;
+
+static void msspi_reclaim_thread()
+{
+    std::vector<MSSPI_HANDLE> handles;
+
+    for( ;; )
+    {
+        {
+            std::unique_lock<std::mutex> lck( g_reclaim_mutex );
+
+            while( g_reclaim_queue.empty() )
+                g_reclaim_cv.wait( lck );
+
+            handles.swap( g_reclaim_queue );
+        }
+
+        for( size_t i = 0; i < handles.size(); i++ )
+            msspi_close( handles[i] );
+
+        GOSTSSL_COUNT_N( msspi_reclaimed, handles.size() );
+        handles.clear();
+    }
+}
+
+static void msspi_reclaim_start()
+{
+    std::thread( msspi_reclaim_thread ).detach();
+}
+
+static void msspi_reclaim( MSSPI_HANDLE h )
+{
+    if( !g_reclaim )
+    {
+        msspi_close( h );
+        return;
+    }
+
+    std::call_once( g_reclaim_once, msspi_reclaim_start );
+
+    {
+        std::unique_lock<std::mutex> lck( g_reclaim_mutex );
+        g_reclaim_queue.push_back( h );
+    }
+
+    g_reclaim_cv.notify_one();
+}
+
+static void workers_init()
+{
+    g_worker_pool = gostssl_config( "GOSTSSL_WORKER_POOL", GOSTSSL_WORKER_POOL );
+    g_reclaim = gostssl_config( "GOSTSSL_RECLAIM", 1 ) != 0;
+    g_handshake_threads = gostssl_config( "GOSTSSL_HANDSHAKE_THREADS", GOSTSSL_HANDSHAKE_THREADS );
+    g_false_start = gostssl_config( "GOSTSSL_FALSE_START", GOSTSSL_FALSE_START ) != 0;
+}
+
+static GostSSL_Worker * worker_alloc()
+{
+    std::vector<GostSSL_Worker *> & pool = g_workers_pool.free;
+
+    if( pool.empty() )
+    {
+        GOSTSSL_COUNT( workers_allocated );
+        return new GostSSL_Worker();
+    }
+
+    GOSTSSL_COUNT( workers_reused );
+    GostSSL_Worker * w = pool.back();
+    pool.pop_back();
+    return w;
+}
+
+static void worker_release( GostSSL_Worker * w )
+{
+    std::vector<GostSSL_Worker *> & pool = g_workers_pool.free;
+
+    if( pool.size() >= g_worker_pool )
+    {
+        delete w;
+        return;
+    }
+
+    if( pool.capacity() < g_worker_pool )
+        pool.reserve( g_worker_pool );
+
+    w->reset();
+    pool.push_back( w );
+}
+
+typedef enum
+{
+    WDB_SEARCH,
+    WDB_NEW,
+    WDB_FREE,
+}
+WORKER_DB_ACTION;
+
+// workers are bound to their SSL through ex_data,
+// an SSL is never used by two threads at once, so no locking is needed
+GostSSL_Worker * workers_api( SSL * s, WORKER_DB_ACTION action, const char * cachestring = NULL, const char * domain = NULL )
+{
+    GostSSL_Worker * w = (GostSSL_Worker *)bssls->SSL_get_ex_data( s, g_worker_index );
+
+    if( action == WDB_SEARCH )
+        return w;
+
+    if( w )
+    {
+        // msspi handshake was abandoned or failed, a false started one
+        // got as far as a verified chain, closing it early is no failure
+        if( action == WDB_FREE && w->is_handshake_started && !w->is_handshake_done && !w->is_false_start )
+        {
+            if( w->host_inferred.empty() )
+                host_status_event( w->host_string, HOST_EVENT_HANDSHAKE_FAILED );
+            else
+                host_status_reject( w->host_string, w->host_inferred );
+
+            if( w->session_generation )
+                session_drop( w->host_string, w->session_generation );
+        }
+
+        bssls->SSL_set_ex_data( s, g_worker_index, NULL );
+
+        if( handshake_release( w ) && verify_release( w ) )
+            worker_release( w );
+
+        w = NULL;
+    }
+
+    if( action == WDB_FREE )
+        return NULL;
+
+    w = worker_alloc();
+    w->s = s;
+
+    w->host_string = s->tlsext_hostname ? s->tlsext_hostname : "*";
+    w->host_string += ":";
+    w->host_string += cachestring ? cachestring : "*";
+
+    if( cachestring )
+        w->cachestring = cachestring;
+
+    if( domain )
+        w->host_domain = domain;
+
+    w->host_status = host_status_get( w->host_string, w->host_domain, &w->host_inferred );
+
+    if( !bssls->SSL_set_ex_data( s, g_worker_index, w ) )
+    {
+        worker_release( w );
+        return NULL;
+    }
+
+    // boringssl skips gostssl for unmarked connections
+    bssls->gostssl_mark( s, w->host_status != GOSTSSL_HOST_NO );
+
+    return w;
+}
+
+// the msspi side of a worker, on the first msspi handshake
+static bool worker_open( GostSSL_Worker * w )
+{
+    SSL * s = w->s;
+
+    w->h = msspi_open( w, (msspi_read_cb)gostssl_read_cb, (msspi_write_cb)gostssl_write_cb );
+
+    if( !w->h )
+        return false;
+
+    GOSTSSL_COUNT( msspi_opened );
+
+    msspi_set_cert_cb( w->h, (msspi_cert_cb)gostssl_cert_cb );
+
+    if( s->tlsext_hostname )
+        msspi_set_hostname( w->h, s->tlsext_hostname );
+    if( !w->cachestring.empty() )
+    {
+        session_get( w->host_string, w->session_generation );
+
+        std::string session_key = w->cachestring;
+        session_key += "#";
+        session_key += std::to_string( w->session_generation );
+        msspi_set_cachestring( w->h, session_key.c_str() );
+    }
+    if( s->alpn_client_proto_list && s->alpn_client_proto_list_len )
+        msspi_set_alpn( w->h, s->alpn_client_proto_list, s->alpn_client_proto_list_len );
+
+    return true;
+}
+
+void gostssl_certbind( void * s, void * cert, int size )
+{
+    if( !s || !cert )
+        return;
+
+    GostSSL_Worker * w = workers_api( (SSL *)s, WDB_SEARCH );
+
+    if( !w || w->client_cert )
+        return;
+
+    if( size == 0 )
+        w->client_cert = CertDuplicateCertificateContext( (PCCERT_CONTEXT)cert );
+    else
+        w->client_cert = CertCreateCertificateContext( X509_ASN_ENCODING, (BYTE *)cert, size );
+}
+
+// a GOST suite boringssl offers, but cannot run itself
+static bool is_gost_cipher( const SSL_CIPHER * cipher )
+{
+    return cipher && ( cipher == tlsgost2001 || cipher == tlsgost2012 ||
+        cipher == tlsgostkuznyechik || cipher == tlsgostmagma );
+}
+
+// a host is found to require GOST when boringssl's own handshake gets
+// a GOST suite in a TLS 1.2 ServerHello; boringssl offers no GOST TLS 1.3
+// suites or key shares, so a server that speaks GOST over TLS 1.3 alone
+// ends that handshake with an alert and is never probed, it is reached
+// only through the preload list or GOSTSSL_PRELOAD, where msspi runs the
+// handshake from the start and may negotiate TLS 1.3
+
+int gostssl_tls_gost_required( SSL * s )
+{
+    GostSSL_Worker * w = workers_api( s, WDB_SEARCH );
+
+    if( w && w->host_status != GOSTSSL_HOST_NO && is_gost_cipher( s->s3->hs->new_cipher ) )
+    {
+        // no CSP to retry with
+        if( !csp_ready() )
+            return 0;
+
+        // probe limit reached, let boringssl fail on its own
+        if( host_status_event( w->host_string, HOST_EVENT_GOST_REQUIRED ) == GOSTSSL_HOST_NO )
+            return 0;
+
+        bssls->ERR_clear_error();
+        bssls->ERR_put_error( ERR_LIB_SSL, 0, SSL_R_TLS_GOST_REQUIRED, __FILE__, __LINE__ );
+        return 1;
+    }
+
+    return 0;
+}
+
+// the wire version boringssl keeps in s->version, TLS 1.3 is the draft
+// version this boringssl speaks, ssl3_protocol_version() rejects 0x0304
+static int msspi_to_ssl_version( DWORD dwProtocol )
+{
+    switch( dwProtocol )
+    {
+        case 0x00000301:
+        case 0x00000040 /*SP_PROT_TLS1_SERVER*/:
+        case 0x00000080 /*SP_PROT_TLS1_CLIENT*/:
+            return TLS1_VERSION;
+
+        case 0x00000302:
+        case 0x00000100 /*SP_PROT_TLS1_1_SERVER*/:
+        case 0x00000200 /*SP_PROT_TLS1_1_CLIENT*/:
+            return TLS1_1_VERSION;
+
+        case 0x00000303:
+        case 0x00000400 /*SP_PROT_TLS1_2_SERVER*/:
+        case 0x00000800 /*SP_PROT_TLS1_2_CLIENT*/:
+            return TLS1_2_VERSION;
+
+        // protocol version as sent on the wire
+        case 0x00000304:
+            return TLS1_3_DRAFT_VERSION;
+
+        case 0x00001000 /*SP_PROT_TLS1_3_SERVER*/:
+        case 0x00002000 /*SP_PROT_TLS1_3_CLIENT*/:
+            return TLS1_3_DRAFT_VERSION;
+
+        default:
+            return SSL3_VERSION;
+    }
+}
+
+static int msspi_to_ssl_state_ret( int state, SSL * s, int ret )
+{
+    if( state & MSSPI_ERROR )
+        s->rwstate = SSL_NOTHING;
+    else if( state & MSSPI_SENT_SHUTDOWN && state & MSSPI_RECEIVED_SHUTDOWN )
+        s->rwstate = SSL_NOTHING;
+    else if( state & MSSPI_X509_LOOKUP )
+        s->rwstate = SSL_X509_LOOKUP;
+    else if( state & MSSPI_WRITING )
+    {
+        if( state & MSSPI_LAST_PROC_WRITE )
+            s->rwstate = SSL_WRITING;
+        else if( state & MSSPI_READING )
+            s->rwstate = SSL_READING;
+        else
+            s->rwstate = SSL_WRITING;
+    }
+    else if( state & MSSPI_READING )
+        s->rwstate = SSL_READING;
+    else
+        s->rwstate = SSL_NOTHING;
+
+    return ret;
+}
+
+static int false_start_finish( GostSSL_Worker * w );
+static int false_start_queue( GostSSL_Worker * w, const void * buf, int len );
+
+// per-suite traffic
+//
+// application bytes read and written are counted for the negotiated
+// suite, so suites can be compared on real traffic
+
+static GOSTSSL_COUNTER suite_counter( const SSL_CIPHER * cipher )
+{
+    if( !cipher )
+        return GOSTSSL_COUNTERS_COUNT;
+
+    if( cipher == tlsgost2001 )
+        return GOSTSSL_COUNTER_suite_2001_bytes;
+
+    if( cipher == tlsgost2012 )
+        return GOSTSSL_COUNTER_suite_2012_bytes;
+
+    if( cipher == tlsgostkuznyechik )
+        return GOSTSSL_COUNTER_suite_kuznyechik_bytes;
+
+    if( cipher == tlsgostmagma )
+        return GOSTSSL_COUNTER_suite_magma_bytes;
+
+    return GOSTSSL_COUNTERS_COUNT;
+}
+
+static void suite_count( GostSSL_Worker * w, size_t n )
+{
+    if( w->suite_bytes != GOSTSSL_COUNTERS_COUNT )
+        g_counters[w->suite_bytes].fetch_add( n, std::memory_order_relaxed );
+}
+
+// plaintext read-ahead
+//
+// a record is decrypted into the worker when the caller's buffer cannot
+// take it whole, what is left serves the next reads, SSL_peek and
+// SSL_pending without another trip through msspi
+
+#define GOSTSSL_RECORD_MAX 16384
+
+static int gostssl_read_ahead( GostSSL_Worker * w )
+{
+    if( w->pbuf.size() != GOSTSSL_RECORD_MAX )
+        w->pbuf.resize( GOSTSSL_RECORD_MAX );
+
+    int ret = msspi_read( w->h, &w->pbuf[0], (int)w->pbuf.size() );
+
+    w->pbuf_head = 0;
+    w->pbuf_tail = ret > 0 ? (size_t)ret : 0;
+
+    return ret;
+}
+
+int gostssl_read( SSL * s, void * buf, int len, int * is_gost )
+{
+    GostSSL_Worker * w = workers_api( s, WDB_SEARCH );
+
+    // fallback
+    if( !w || w->host_status != GOSTSSL_HOST_YES )
+    {
+        // handshake is done by boringssl, no way back to gostssl
+        bssls->gostssl_mark( s, 0 );
+        *is_gost = FALSE;
+        return 1;
+    }
+
+    *is_gost = TRUE;
+
+    if( w->is_false_start )
+    {
+        int ret = false_start_finish( w );
+
+        if( ret <= 0 )
+            return ret;
+    }
+
+    if( w->pbuf_head == w->pbuf_tail )
+    {
+        // whole records fit, no need to buffer
+        if( len >= GOSTSSL_RECORD_MAX )
+        {
+            int ret = msspi_read( w->h, buf, len );
+
+            if( ret > 0 )
+            {
+                GOSTSSL_COUNT_N( io_plain_direct_bytes, ret );
+                suite_count( w, ret );
+            }
+
+            return msspi_to_ssl_state_ret( msspi_state( w->h ), s, ret );
+        }
+
+        int ret = gostssl_read_ahead( w );
+
+        if( ret <= 0 )
+            return msspi_to_ssl_state_ret( msspi_state( w->h ), s, ret );
+    }
+
+    size_t n = w->pbuf_tail - w->pbuf_head;
+
+    if( n > (size_t)len )
+        n = (size_t)len;
+
+    memcpy( buf, &w->pbuf[w->pbuf_head], n );
+    w->pbuf_head += n;
+    s->rwstate = SSL_NOTHING;
+
+    GOSTSSL_COUNT_N( io_plain_buffered_bytes, n );
+    suite_count( w, n );
+
+    return (int)n;
+}
+
+int gostssl_peek( SSL * s, void * buf, int len, int * is_gost )
+{
+    GostSSL_Worker * w = workers_api( s, WDB_SEARCH );
+
+    // fallback
+    if( !w || w->host_status != GOSTSSL_HOST_YES )
+    {
+        // handshake is done by boringssl, no way back to gostssl
+        bssls->gostssl_mark( s, 0 );
+        *is_gost = FALSE;
+        return 1;
+    }
+
+    *is_gost = TRUE;
+
+    if( w->is_false_start )
+    {
+        int ret = false_start_finish( w );
+
+        if( ret <= 0 )
+            return ret;
+    }
+
+    if( w->pbuf_head == w->pbuf_tail )
+    {
+        int ret = gostssl_read_ahead( w );
+
+        if( ret <= 0 )
+            return msspi_to_ssl_state_ret( msspi_state( w->h ), s, ret );
+    }
+
+    size_t n = w->pbuf_tail - w->pbuf_head;
+
+    if( n > (size_t)len )
+        n = (size_t)len;
+
+    memcpy( buf, &w->pbuf[w->pbuf_head], n );
+    s->rwstate = SSL_NOTHING;
+
+    return (int)n;
+}
+
+int gostssl_pending( const SSL * s, int * is_gost )
+{
+    GostSSL_Worker * w = workers_api( (SSL *)s, WDB_SEARCH );
+
+    if( !w || w->host_status != GOSTSSL_HOST_YES )
+    {
+        *is_gost = FALSE;
+        return 0;
+    }
+
+    *is_gost = TRUE;
+
+    return (int)( w->pbuf_tail - w->pbuf_head );
+}
+
+// write path
+//
+// writes are cut into full records, small records only come from small
+// SSL_write calls and are counted to see what coalescing would gain
+
+static int gostssl_write_record( GostSSL_Worker * w, const void * buf, int len )
+{
+    int ret = msspi_write( w->h, buf, len );
+
+    if( ret > 0 )
+    {
+        GOSTSSL_COUNT( write_records );
+        GOSTSSL_COUNT_N( write_record_bytes, ret );
+        suite_count( w, ret );
+
+        if( ret < GOSTSSL_RECORD_MAX )
+            GOSTSSL_COUNT( write_small_records );
+    }
+
+    return ret;
+}
+
+int gostssl_write( SSL * s, const void * buf, int len, int * is_gost )
+{
+    GostSSL_Worker * w = workers_api( s, WDB_SEARCH );
+
+    // fallback
+    if( !w || w->host_status != GOSTSSL_HOST_YES )
+    {
+        // handshake is done by boringssl, no way back to gostssl
+        bssls->gostssl_mark( s, 0 );
+        *is_gost = FALSE;
+        return 1;
+    }
+
+    *is_gost = TRUE;
+
+    GOSTSSL_COUNT( write_calls );
+
+    if( w->is_false_start )
+    {
+        int ret = false_start_finish( w );
+
+        if( ret <= 0 )
+        {
+            if( s->rwstate != SSL_READING )
+                return ret;
+
+            return false_start_queue( w, buf, len );
+        }
+    }
+
+    int written = 0;
+
+    while( written < len )
+    {
+        int chunk = GOSTSSL_RECORD_MAX;
+
+        if( chunk > len - written )
+            chunk = len - written;
+
+        int ret = gostssl_write_record( w, (const char *)buf + written, chunk );
+
+        if( ret > 0 )
+            written += ret;
+
+        if( ret != chunk )
+        {
+            if( written )
+                break;
+
+            return msspi_to_ssl_state_ret( msspi_state( w->h ), s, ret );
+        }
+    }
+
+    s->rwstate = SSL_NOTHING;
+    return written;
+}
+
+void gostssl_cachestring( SSL * s, const char * cachestring, const char * domain )
+{
+    // no CSP, boringssl handles everything without workers
+    if( g_csp_state.load( std::memory_order_acquire ) == CSP_FAILED )
+        return;
+
+    workers_api( s, WDB_NEW, cachestring, domain );
+}
+
+// handshake offload
+//
+// msspi_connect() does the key agreement, signature checks and token
+// signing on the calling thread, once a wake callback is registered
+// through gostssl_handshake_wake() the handshake runs on a pool of
+// GOSTSSL_HANDSHAKE_THREADS threads instead: a job never touches the BIO,
+// it consumes what the network thread read into the worker and leaves
+// its output there, the client certificate is still chosen on the
+// network thread, while a job runs the SSL reports SSL_ERROR_WANT_READ
+// and the callback wakes the caller when the job is done
+
+typedef enum
+{
+    HANDSHAKE_JOB_IDLE,
+    HANDSHAKE_JOB_RUNNING,
+    HANDSHAKE_JOB_DONE,
+}
+HANDSHAKE_JOB;
+
+// never destroyed, pool threads may still wait on them at exit
+static std::mutex & g_handshake_mutex = *new std::mutex;
+static std::condition_variable & g_handshake_cv = *new std::condition_variable;
+static std::deque< GostSSL_Worker * > & g_handshake_queue = *new std::deque< GostSSL_Worker * >;
+static std::once_flag g_handshake_once;
+
+static bool false_start_ready( GostSSL_Worker * w );
+
+static void handshake_thread()
+{
+    for( ;; )
+    {
+        GostSSL_Worker * w;
+
+        {
+            std::unique_lock<std::mutex> lck( g_handshake_mutex );
+
+            while( g_handshake_queue.empty() )
+                g_handshake_cv.wait( lck );
+
+            w = g_handshake_queue.front();
+            g_handshake_queue.pop_front();
+        }
+
+        uint64_t start = gostssl_time_us();
+        int ret = msspi_connect( w->h );
+        GOSTSSL_COUNT_N( handshake_offloaded_us, gostssl_time_us() - start );
+
+        bool is_orphan;
+
+        {
+            std::unique_lock<std::mutex> lck( g_handshake_mutex );
+
+            w->handshake_ret = ret;
+            w->handshake_job = HANDSHAKE_JOB_DONE;
+            is_orphan = w->is_handshake_orphan;
+
+            // under the lock, the worker cannot be released meanwhile
+            if( !is_orphan )
+                w->wake( w->wake_arg, 0 );
+        }
+
+        // its SSL is gone, the worker is ours
+        if( is_orphan )
+            delete w;
+    }
+}
+
+static void handshake_pool_start()
+{
+    for( unsigned i = 0; i < g_handshake_threads; i++ )
+        std::thread( handshake_thread ).detach();
+}
+
+static void handshake_start( GostSSL_Worker * w )
+{
+    std::call_once( g_handshake_once, handshake_pool_start );
+
+    GOSTSSL_COUNT( handshake_jobs );
+
+    {
+        std::unique_lock<std::mutex> lck( g_handshake_mutex );
+        w->is_offloaded = true;
+        w->handshake_job = HANDSHAKE_JOB_RUNNING;
+        g_handshake_queue.push_back( w );
+    }
+
+    g_handshake_cv.notify_one();
+}
+
+static bool handshake_release( GostSSL_Worker * w )
+{
+    std::unique_lock<std::mutex> lck( g_handshake_mutex );
+
+    if( w->handshake_job != HANDSHAKE_JOB_RUNNING )
+        return true;
+
+    w->is_handshake_orphan = true;
+    w->s = NULL;
+
+    return false;
+}
+
+// output of a job goes to the BIO on the network thread
+static bool handshake_flush( GostSSL_Worker * w )
+{
+    while( w->obuf_head < w->obuf.size() )
+    {
+        int ret = gostssl_write_cb( w, &w->obuf[w->obuf_head], (int)( w->obuf.size() - w->obuf_head ) );
+
+        if( ret <= 0 )
+            return false;
+
+        w->obuf_head += (size_t)ret;
+    }
+
+    w->obuf.clear();
+    w->obuf_head = 0;
+
+    return true;
+}
+
+// input of the next job
+static int handshake_fill( GostSSL_Worker * w )
+{
+    size_t size = g_read_ahead ? g_read_ahead : GOSTSSL_READ_AHEAD;
+
+    if( w->rbuf.size() < size )
+        w->rbuf.resize( size );
+
+    int ret = bssls->BIO_read( w->s->rbio, &w->rbuf[0], (int)w->rbuf.size() );
+
+    GOSTSSL_COUNT( io_bio_reads );
+
+    if( ret > 0 )
+    {
+        w->rbuf_head = 0;
+        w->rbuf_tail = (size_t)ret;
+    }
+
+    return ret;
+}
+
+// one step of an offloaded handshake on the network thread, returns what
+// msspi_connect() returned, unless |is_pending| is set: the return value
+// and rwstate are then final and the handshake goes on later
+static int handshake_step( GostSSL_Worker * w, bool & is_pending )
+{
+    SSL * s = w->s;
+    int job;
+
+    is_pending = true;
+
+    {
+        std::unique_lock<std::mutex> lck( g_handshake_mutex );
+        job = w->handshake_job;
+    }
+
+    if( job == HANDSHAKE_JOB_RUNNING )
+    {
+        s->rwstate = SSL_READING;
+        return -1;
+    }
+
+    if( job == HANDSHAKE_JOB_DONE )
+    {
+        w->is_offloaded = false;
+
+        if( !handshake_flush( w ) )
+        {
+            s->rwstate = SSL_WRITING;
+            return -1;
+        }
+
+        w->handshake_job = HANDSHAKE_JOB_IDLE;
+
+        int ret = w->handshake_ret;
+        int state = msspi_state( w->h );
+
+        if( ret == 1 || ( state & MSSPI_ERROR ) || !( state & ( MSSPI_READING | MSSPI_X509_LOOKUP ) ) || false_start_ready( w ) )
+        {
+            is_pending = false;
+            return ret;
+        }
+
+        if( state & MSSPI_X509_LOOKUP )
+        {
+            // the application is asked here, the job resumes with its answer
+            if( gostssl_cert_select( w ) <= 0 )
+            {
+                is_pending = false;
+                return ret;
+            }
+        }
+        else if( w->rbuf_head == w->rbuf_tail )
+        {
+            int n = handshake_fill( w );
+
+            if( n <= 0 )
+            {
+                s->rwstate = n < 0 ? SSL_READING : SSL_NOTHING;
+                return n;
+            }
+        }
+    }
+
+    handshake_start( w );
+
+    s->rwstate = SSL_READING;
+    return -1;
+}
+
+int gostssl_handshake_wake( SSL * s, gostssl_wake_cb wake, void * arg )
+{
+    GostSSL_Worker * w = workers_api( s, WDB_SEARCH );
+
+    if( !w || !wake || w->wake || !g_handshake_threads )
+        return 0;
+
+    w->wake = wake;
+    w->wake_arg = arg;
+
+    return 1;
+}
+
+// one step of the handshake, offloaded or in place
+static int handshake_advance( GostSSL_Worker * w, bool & is_pending )
+{
+    if( w->wake )
+        return handshake_step( w, is_pending );
+
+    is_pending = false;
+
+    uint64_t start = gostssl_time_us();
+    int ret = msspi_connect( w->h );
+    GOSTSSL_COUNT_N( handshake_inline_us, gostssl_time_us() - start );
+
+    return ret;
+}
+
+// the first handshake completed, the host is known to speak GOST
+static void handshake_confirmed( GostSSL_Worker * w )
+{
+    w->is_handshake_done = true;
+    host_status_event( w->host_string, HOST_EVENT_HANDSHAKE_OK );
+    host_status_propagate( w->host_string, w->host_domain );
+
+    if( w->session_generation )
+        session_put( w->host_string, w->session_generation );
+
+    if( !w->host_inferred.empty() )
+        GOSTSSL_COUNT( host_inferred_confirmed );
+}
+
+// false start
+//
+// msspi finishes a handshake only when the server's Finished arrives,
+// application data cannot be sent before it, but the peer chain and the
+// cipher are known as soon as the client's last flight is out: the
+// handshake is reported done right then, so the caller verifies the chain
+// while the server's Finished is on its way; only the verification
+// overlaps, up to a record it writes meanwhile is kept in the worker and
+// goes out after the server's Finished as it would without false start,
+// the first read or write completes the handshake, the chain it ends
+// with must be the one that was reported, or the connection fails; a
+// TLS 1.3 client sends its Finished after the server's, there is nothing
+// to gain; GOSTSSL_FALSE_START=0 turns it off
+
+static bool verify_cache_key( GostSSL_Worker * w, std::string & key, uint32_t & not_after );
+static bool verify_running( GostSSL_Worker * w );
+
+static bool false_start_ready( GostSSL_Worker * w )
+{
+    if( !g_false_start || w->is_false_start || w->is_handshake_done )
+        return false;
+
+    int state = msspi_state( w->h );
+
+    if( ( state & ( MSSPI_ERROR | MSSPI_X509_LOOKUP | MSSPI_WRITING | MSSPI_READING ) ) != MSSPI_READING )
+        return false;
+
+    PSecPkgContext_CipherInfo cipher_info = msspi_get_cipherinfo( w->h );
+
+    if( !cipher_info || msspi_to_ssl_version( cipher_info->dwProtocol ) == TLS1_3_DRAFT_VERSION )
+        return false;
+
+    uint32_t not_after;
+
+    return verify_cache_key( w, w->false_start_key, not_after );
+}
+
+// at most a record is kept, the caller waits for the rest
+static int false_start_queue( GostSSL_Worker * w, const void * buf, int len )
+{
+    if( len <= 0 )
+        return 0;
+
+    size_t room = GOSTSSL_RECORD_MAX - w->early.size();
+
+    if( !room )
+    {
+        w->s->rwstate = SSL_READING;
+        return -1;
+    }
+
+    if( (size_t)len > room )
+        len = (int)room;
+
+    w->early.insert( w->early.end(), (const char *)buf, (const char *)buf + len );
+    w->s->rwstate = SSL_NOTHING;
+
+    GOSTSSL_COUNT_N( false_start_bytes, len );
+
+    return len;
+}
+
+// returns 1 once the handshake is complete and the queued data is sent
+static int false_start_finish( GostSSL_Worker * w )
+{
+    SSL * s = w->s;
+
+    // the chain is being verified, the handle is not ours
+    if( verify_running( w ) )
+    {
+        s->rwstate = SSL_READING;
+        return -1;
+    }
+
+    if( !w->is_handshake_done )
+    {
+        bool is_pending;
+        int ret = handshake_advance( w, is_pending );
+
+        if( is_pending )
+            return ret;
+
+        if( ret != 1 )
+            return msspi_to_ssl_state_ret( msspi_state( w->h ), s, ret );
+
+        std::string key;
+        uint32_t not_after;
+
+        if( !verify_cache_key( w, key, not_after ) || key != w->false_start_key )
+        {
+            GOSTSSL_COUNT( false_start_mismatches );
+            bssls->ERR_put_error( ERR_LIB_SSL, 0, SSL_R_SERVER_CERT_CHANGED, __FILE__, __LINE__ );
+            s->rwstate = SSL_NOTHING;
+            return -1;
+        }
+
+        handshake_confirmed( w );
+        w->false_start_key.clear();
+    }
+
+    size_t head = 0;
+
+    while( head < w->early.size() )
+    {
+        int chunk = GOSTSSL_RECORD_MAX;
+
+        if( (size_t)chunk > w->early.size() - head )
+            chunk = (int)( w->early.size() - head );
+
+        int ret = gostssl_write_record( w, &w->early[head], chunk );
+
+        if( ret <= 0 )
+        {
+            w->early.erase( w->early.begin(), w->early.begin() + head );
+            return msspi_to_ssl_state_ret( msspi_state( w->h ), s, ret );
+        }
+
+        head += (size_t)ret;
+    }
+
+    w->early.clear();
+    w->is_false_start = false;
+
+    return 1;
+}
+
+int gostssl_connect( SSL * s, int * is_gost )
+{
+    GostSSL_Worker * w = workers_api( s, WDB_SEARCH );
+
+    // no CSP, this connection is left to boringssl
+    if( w && !w->h && ( w->host_status == GOSTSSL_HOST_PROBING || w->host_status == GOSTSSL_HOST_YES ) && !csp_ready() )
+        w->host_status = GOSTSSL_HOST_NO;
+
+    // fallback
+    if( !w || w->host_status == GOSTSSL_HOST_AUTO || w->host_status == GOSTSSL_HOST_NO )
+    {
+        if( !w || w->host_status == GOSTSSL_HOST_NO )
+            bssls->gostssl_mark( s, 0 );
+
+        *is_gost = FALSE;
+        return 1;
+    }
+
+    *is_gost = TRUE;
+
+    if( !w->h && !worker_open( w ) )
+    {
+        s->rwstate = SSL_NOTHING;
+        return -1;
+    }
+
+    if( s->s3->hs->state == SSL_ST_INIT )
+        s->s3->hs->state = SSL_ST_CONNECT;
+
+    // reported done already
+    if( w->is_false_start )
+    {
+        s->rwstate = SSL_NOTHING;
+        return 1;
+    }
+
+    if( !w->is_handshake_started )
+    {
+        w->is_handshake_started = true;
+        w->handshake_start_us = gostssl_time_us();
+    }
+
+    bool is_pending;
+    int ret = handshake_advance( w, is_pending );
+
+    if( is_pending )
+        return ret;
+
+    if( ret != 1 && false_start_ready( w ) )
+    {
+        w->is_false_start = true;
+        ret = 1;
+
+        GOSTSSL_COUNT( false_starts );
+    }
+
+    if( ret == 1 )
+    {
+        s->rwstate = SSL_NOTHING;
+
+        // skip
+        if( s->s3->established_session &&
+            s->s3->established_session->cipher &&
+            s->s3->aead_write_ctx &&
+            s->s3->aead_write_ctx->cipher )
+        {
+            s->s3->hs->state = SSL_ST_OK;
+            return 1;
+        }
+
+        {
+            const char * alpn = msspi_get_alpn( w->h );
+            size_t alpn_len;
+
+            if( s->s3->alpn_selected )
+                bssls->BORINGSSL_free( s->s3->alpn_selected );
+
+            if( !alpn )
+                alpn = "http/1.1";
+
+            alpn_len = strlen( alpn );
+
+            s->s3->alpn_selected = (uint8_t *)bssls->BORINGSSL_malloc( alpn_len );
+
+            if( !s->s3->alpn_selected )
+                return 0;
+
+            memcpy( s->s3->alpn_selected, alpn, alpn_len );
+            s->s3->alpn_selected_len = alpn_len;
+        }
+
+        // cipher
+        {
+            PSecPkgContext_CipherInfo cipher_info = msspi_get_cipherinfo( w->h );
+
+            if( !cipher_info )
+                return 0;
+
+            const SSL_CIPHER * cipher = bssls->SSL_get_cipher_by_value( (uint16_t)cipher_info->dwCipherSuite );
+
+            if( !cipher )
+                return 0;
+
+            w->suite_bytes = suite_counter( cipher );
+            s->version = (uint16_t)msspi_to_ssl_version( cipher_info->dwProtocol );
+            s->s3->have_version = 1;
+
+            // mimic boringssl
+            if( bssls->ssl_get_new_session( s->s3->hs, 0 ) <= 0 )
+                return 0;
+
+            s->s3->established_session = s->s3->hs->new_session;
+            s->s3->hs->new_session = NULL;
+
+            s->s3->established_session->ssl_version = s->version;
+            s->s3->established_session->cipher = cipher;
+
+            // as the caller sees it, a false start ends here
+            uint64_t handshake_us = gostssl_time_us() - w->handshake_start_us;
+
+            if( s->version == TLS1_3_DRAFT_VERSION )
+            {
+                GOSTSSL_COUNT( handshakes_tls13 );
+                GOSTSSL_COUNT_N( handshake_tls13_us, handshake_us );
+            }
+            else
+            {
+                GOSTSSL_COUNT( handshakes_tls12 );
+                GOSTSSL_COUNT_N( handshake_tls12_us, handshake_us );
+            }
+
+            {
+                if( s->s3->aead_write_ctx )
+                    bssls->BORINGSSL_free( s->s3->aead_write_ctx );
+
+                s->s3->aead_write_ctx = (SSL_AEAD_CTX *)bssls->BORINGSSL_malloc( sizeof( ssl_aead_ctx_st ) );
+
+                if( !s->s3->aead_write_ctx )
+                    return 0;
+
+                memset( s->s3->aead_write_ctx, 0, sizeof( ssl_aead_ctx_st ) );
+                s->s3->aead_write_ctx->cipher = cipher;
+            }
+        }
+
+        // mimic ssl3_get_server_certificate
+        {
+            STACK_OF( CRYPTO_BUFFER ) * sk;
+            sk = ( STACK_OF( CRYPTO_BUFFER ) * )bssls->sk_new_null();
+
+            if( !sk )
+                return 0;
+
+            s->s3->established_session->certs = sk;
+
+            std::vector<const char *> bufs;
+            std::vector<int> lens;
+            size_t count;
+
+            if( !msspi_get_peercerts( w->h, NULL, NULL, &count ) )
+                return 0;
+
+            bufs.resize( count );
+            lens.resize( count );
+
+            bool is_OK = false;
+
+            if( msspi_get_peercerts( w->h, &bufs[0], &lens[0], &count ) )
+            {
+                for( size_t i = 0; i < count; i++ )
+                {
+                    CRYPTO_BUFFER * buf = bssls->CRYPTO_BUFFER_new( (const uint8_t *)bufs[i], lens[i], s->ctx->pool );
+
+                    if( !buf )
+                        break;
+
+                    bssls->sk_push( CHECKED_CAST( _STACK *, STACK_OF( CRYPTO_BUFFER ) *, sk ), CHECKED_CAST( void *, CRYPTO_BUFFER *, buf ) );
+                    is_OK = true;
+                }
+            }
+
+            if( !is_OK )
+                return 0;
+        }
+
+        // callback SSL_CB_HANDSHAKE_DONE
+        if( s->info_callback != NULL )
+            s->info_callback( s, SSL_CB_HANDSHAKE_DONE, 1 );
+        else if( s->ctx->info_callback != NULL )
+            s->ctx->info_callback( s, SSL_CB_HANDSHAKE_DONE, 1 );
+
+        s->s3->hs->state = SSL_ST_OK;
+        w->host_status = GOSTSSL_HOST_YES;
+
+        if( !w->is_false_start )
+            handshake_confirmed( w );
+
+        return 1;
+    }
+
+    int state = msspi_state( w->h );
+
+    // an inferred host that fails is resent through boringssl
+    if( ( state & MSSPI_ERROR ) && !w->host_inferred.empty() )
+    {
+        host_status_reject( w->host_string, w->host_inferred );
+
+        if( w->session_generation )
+            session_drop( w->host_string, w->session_generation );
+
+        // reported here, not again on free
+        w->host_inferred.clear();
+        w->is_handshake_started = false;
+        w->host_status = GOSTSSL_HOST_NO;
+        bssls->gostssl_mark( s, 0 );
+
+        bssls->ERR_clear_error();
+        bssls->ERR_put_error( ERR_LIB_SSL, 0, SSL_R_TLS_GOST_REQUIRED, __FILE__, __LINE__ );
+        s->rwstate = SSL_NOTHING;
+        return -1;
+    }
+
+    return msspi_to_ssl_state_ret( state, s, ret );
+}
+
+void gostssl_free( SSL * s )
+{
+    workers_api( s, WDB_FREE );
+}
+
+// verification cache
+//
+// parallel connections to a host present the same chain, outcomes are
+// cached by a digest of hostname and peer chain, the whole key is kept
+// and compared so a digest collision is only a miss, entries live for
+// GOSTSSL_VERIFY_TTL (revocation data freshness) or GOSTSSL_VERIFY_ERROR_TTL,
+// never past the earliest NotAfter in the chain
+
+#define GOSTSSL_VERIFY_CACHE_MAX 256
+#define GOSTSSL_VERIFY_TTL 300
+#define GOSTSSL_VERIFY_ERROR_TTL 30
+
+struct VERIFY_ENTRY
+{
+    uint64_t digest;
+    std::string key;
+    unsigned gost_status;
+    uint32_t expires;
+};
+
+typedef std::list< VERIFY_ENTRY > VERIFY_LRU;
+
+static std::mutex g_verify_cache_mutex;
+static VERIFY_LRU g_verify_cache_lru;
+static std::map< uint64_t, VERIFY_LRU::iterator > g_verify_cache;
+static unsigned g_verify_cache_max = GOSTSSL_VERIFY_CACHE_MAX;
+static unsigned g_verify_ttl = GOSTSSL_VERIFY_TTL;
+static unsigned g_verify_error_ttl = GOSTSSL_VERIFY_ERROR_TTL;
+
+static void verify_cache_init()
+{
+    g_verify_cache_max = gostssl_config( "GOSTSSL_VERIFY_CACHE_MAX", GOSTSSL_VERIFY_CACHE_MAX );
+    g_verify_ttl = gostssl_config( "GOSTSSL_VERIFY_TTL", GOSTSSL_VERIFY_TTL );
+    g_verify_error_ttl = gostssl_config( "GOSTSSL_VERIFY_ERROR_TTL", GOSTSSL_VERIFY_ERROR_TTL );
+}
+
+static uint32_t filetime_to_time( const FILETIME & ft )
+{
+    uint64_t t = ( (uint64_t)ft.dwHighDateTime << 32 ) | ft.dwLowDateTime;
+
+    if( t <= 116444736000000000ULL )
+        return 0;
+
+    t = ( t - 116444736000000000ULL ) / 10000000;
+
+    return t > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)t;
+}
+
+static uint64_t verify_digest( const std::string & key )
+{
+    uint64_t h = 14695981039346656037ULL;
+
+    for( size_t i = 0; i < key.size(); i++ )
+    {
+        h ^= (uint8_t)key[i];
+        h *= 1099511628211ULL;
+    }
+
+    return h;
+}
+
+// "hostname\0" followed by length-prefixed peer certificates,
+// |not_after| receives the earliest expiry in the chain
+static bool verify_cache_key( GostSSL_Worker * w, std::string & key, uint32_t & not_after )
+{
+    size_t count;
+
+    if( !msspi_get_peercerts( w->h, NULL, NULL, &count ) || !count )
+        return false;
+
+    std::vector<const char *> bufs( count );
+    std::vector<int> lens( count );
+
+    if( !msspi_get_peercerts( w->h, &bufs[0], &lens[0], &count ) )
+        return false;
+
+    key.assign( w->host_string, 0, w->host_string.find( ':' ) );
+    key += '\0';
+    not_after = 0xFFFFFFFF;
+
+    for( size_t i = 0; i < count; i++ )
+    {
+        PCCERT_CONTEXT certctx = CertCreateCertificateContext( X509_ASN_ENCODING, (const BYTE *)bufs[i], (DWORD)lens[i] );
+
+        if( !certctx )
+            return false;
+
+        uint32_t t = filetime_to_time( certctx->pCertInfo->NotAfter );
+
+        if( t < not_after )
+            not_after = t;
+
+        CertFreeCertificateContext( certctx );
+
+        uint32_t len = (uint32_t)lens[i];
+        key.append( (const char *)&len, sizeof( len ) );
+        key.append( bufs[i], lens[i] );
+    }
+
+    return true;
+}
+
+static bool verify_cache_get( const std::string & key, uint64_t digest, unsigned & gost_status )
+{
+    std::unique_lock<std::mutex> lck( g_verify_cache_mutex );
 
-            if( !sk )
-                return 0;
+    auto it = g_verify_cache.find( digest );
 
-            s->s3->established_session->certs = sk;
+    if( it == g_verify_cache.end() || it->second->key != key )
+        return false;
 
-            std::vector<const char *> bufs;
-            std::vector<int> lens;
-            size_t count;
+    if( (uint32_t)time( NULL ) >= it->second->expires )
+    {
+        g_verify_cache_lru.erase( it->second );
+        g_verify_cache.erase( it );
+        return false;
+    }
 
-            if( !msspi_get_peercerts( w->h, NULL, NULL, &count ) )
-                return 0;
+    g_verify_cache_lru.splice( g_verify_cache_lru.begin(), g_verify_cache_lru, it->second );
+    gost_status = it->second->gost_status;
+    return true;
+}
 
-            bufs.resize( count );
-            lens.resize( count );
+static void verify_cache_put( const std::string & key, uint64_t digest, unsigned gost_status, uint32_t expires )
+{
+    std::unique_lock<std::mutex> lck( g_verify_cache_mutex );
 
-            bool is_OK = false;
+    if( !g_verify_cache_max )
+        return;
 
-            if( msspi_get_peercerts( w->h, &bufs[0], &lens[0], &count ) )
-            {
-                for( size_t i = 0; i < count; i++ )
-                {
-                    CRYPTO_BUFFER * buf = bssls->CRYPTO_BUFFER_new( (const uint8_t *)bufs[i], lens[i], s->ctx->pool );
+    auto it = g_verify_cache.find( digest );
 
-                    if( !buf )
-                        break;
+    if( it != g_verify_cache.end() )
+    {
+        g_verify_cache_lru.erase( it->second );
+        g_verify_cache.erase( it );
+    }
+    else if( g_verify_cache.size() >= g_verify_cache_max )
+    {
+        GOSTSSL_COUNT( verify_cache_evictions );
+        g_verify_cache.erase( g_verify_cache_lru.back().digest );
+        g_verify_cache_lru.pop_back();
+    }
 
-                    bssls->sk_push( CHECKED_CAST( _STACK *, STACK_OF( CRYPTO_BUFFER ) *, sk ), CHECKED_CAST( void *, CRYPTO_BUFFER *, buf ) );
-                    is_OK = true;
-                }
-            }
+    VERIFY_ENTRY e;
+    e.digest = digest;
+    e.key = key;
+    e.gost_status = gost_status;
+    e.expires = expires;
 
-            if( !is_OK )
-                return 0;
-        }
+    g_verify_cache_lru.push_front( e );
+    g_verify_cache[digest] = g_verify_cache_lru.begin();
+}
 
-        // callback SSL_CB_HANDSHAKE_DONE
-        if( s->info_callback != NULL )
-            s->info_callback( s, SSL_CB_HANDSHAKE_DONE, 1 );
-        else if( s->ctx->info_callback != NULL )
-            s->ctx->info_callback( s, SSL_CB_HANDSHAKE_DONE, 1 );
+void gostssl_verify_invalidate( const char * hostname )
+{
+    std::unique_lock<std::mutex> lck( g_verify_cache_mutex );
 
-        s->s3->hs->state = SSL_ST_OK;
-        w->host_status = GOSTSSL_HOST_YES;
-        host_status_set( w->host_string, GOSTSSL_HOST_YES );
+    GOSTSSL_COUNT( verify_cache_invalidations );
 
-        return 1;
+    if( !hostname )
+    {
+        g_verify_cache.clear();
+        g_verify_cache_lru.clear();
+        return;
     }
 
-    return msspi_to_ssl_state_ret( msspi_state( w->h ), s, ret );
-}
+    size_t len = strlen( hostname ) + 1;
 
-void gostssl_free( SSL * s )
-{
-    workers_api( s, WDB_FREE );
+    for( auto it = g_verify_cache_lru.begin(); it != g_verify_cache_lru.end(); )
+    {
+        if( it->key.size() >= len && 0 == memcmp( it->key.data(), hostname, len ) )
+        {
+            g_verify_cache.erase( it->digest );
+            it = g_verify_cache_lru.erase( it );
+        }
+        else
+        {
+            ++it;
+        }
+    }
 }
 
-void gostssl_verifyhook( void * s, unsigned * gost_status )
+static unsigned gostssl_verify_status( GostSSL_Worker * w )
 {
-    *gost_status = 0;
+    std::string key;
+    uint32_t not_after;
+    uint64_t digest = 0;
+    unsigned gost_status;
 
-    GostSSL_Worker * w = workers_api( (SSL *)s, WDB_SEARCH );
+    bool is_key = verify_cache_key( w, key, not_after );
 
-    if( !w || w->host_status != GOSTSSL_HOST_YES )
-        return;
+    if( is_key )
+    {
+        digest = verify_digest( key );
+
+        if( verify_cache_get( key, digest, gost_status ) )
+        {
+            GOSTSSL_COUNT( verify_cache_hits );
+            return gost_status;
+        }
+
+        GOSTSSL_COUNT( verify_cache_misses );
+    }
 
     unsigned verify_status = msspi_verify( w->h );
 
     switch( verify_status )
     {
         case MSSPI_VERIFY_OK:
-            *gost_status = 1;
+            gost_status = 1;
             break;
         case MSSPI_VERIFY_ERROR:
-            *gost_status = (unsigned)CERT_E_CRITICAL;
+            gost_status = (unsigned)CERT_E_CRITICAL;
             break;
         default:
-            *gost_status = verify_status;
+            gost_status = verify_status;
+    }
+
+    if( is_key )
+    {
+        uint32_t now = (uint32_t)time( NULL );
+        uint32_t ttl = gost_status == 1 ? g_verify_ttl : g_verify_error_ttl;
+        uint32_t expires = now + ttl;
+
+        if( expires > not_after )
+            expires = not_after;
+
+        if( ttl && expires > now )
+            verify_cache_put( key, digest, gost_status, expires );
     }
+
+    return gost_status;
 }
 
-static std::vector<char *> g_certs;
-static std::vector<int> g_certlens;
-static std::vector<std::string> g_certbufs;
+void gostssl_verifyhook( void * s, unsigned * gost_status )
+{
+    *gost_status = 0;
+
+    GostSSL_Worker * w = workers_api( (SSL *)s, WDB_SEARCH );
 
-void gostssl_clientcertshook( char *** certs, int ** lens, int * count, int * is_gost )
+    if( !w || w->host_status != GOSTSSL_HOST_YES )
+        return;
+
+    if( gostssl_verify_poll( s, gost_status ) )
+        return;
+
+    *gost_status = gostssl_verify_status( w );
+}
+
+// asynchronous verification
+//
+// chain building and CRL/OCSP fetches by the CSP may take long,
+// msspi_verify() runs on a pool of GOSTSSL_VERIFY_THREADS threads,
+// |done| is called exactly once from a pool thread for every started
+// job, even if it was cancelled or its SSL was freed meanwhile
+
+#define GOSTSSL_VERIFY_THREADS 2
+
+// never destroyed, pool threads may still wait on them at exit
+static std::mutex & g_verify_mutex = *new std::mutex;
+static std::condition_variable & g_verify_cv = *new std::condition_variable;
+static std::deque< VERIFY_JOB * > & g_verify_queue = *new std::deque< VERIFY_JOB * >;
+static std::once_flag g_verify_once;
+
+static void verify_thread()
 {
-    *is_gost = g_is_gost;
+    for( ;; )
+    {
+        VERIFY_JOB * job;
+        bool is_canceled;
 
-    if( !g_is_gost )
+        {
+            std::unique_lock<std::mutex> lck( g_verify_mutex );
+
+            while( g_verify_queue.empty() )
+                g_verify_cv.wait( lck );
+
+            job = g_verify_queue.front();
+            g_verify_queue.pop_front();
+            is_canceled = job->is_canceled;
+        }
+
+        GostSSL_Worker * w = job->w;
+        unsigned gost_status = is_canceled ? 0 : gostssl_verify_status( w );
+        gostssl_verify_cb done = job->done;
+        void * arg = job->arg;
+        bool is_orphan;
+
+        {
+            std::unique_lock<std::mutex> lck( g_verify_mutex );
+
+            if( job->is_canceled )
+                gost_status = 0;
+
+            job->gost_status = gost_status;
+            job->is_done = true;
+            is_orphan = job->is_orphan;
+        }
+
+        // its SSL is gone, the worker is ours
+        if( is_orphan )
+            delete w;
+
+        done( arg, gost_status );
+    }
+}
+
+static void verify_pool_start()
+{
+    unsigned count = gostssl_config( "GOSTSSL_VERIFY_THREADS", GOSTSSL_VERIFY_THREADS );
+
+    if( !count )
+        count = 1;
+
+    for( unsigned i = 0; i < count; i++ )
+        std::thread( verify_thread ).detach();
+}
+
+int gostssl_verify_start( void * s, gostssl_verify_cb done, void * arg )
+{
+    GostSSL_Worker * w = workers_api( (SSL *)s, WDB_SEARCH );
+
+    if( !w || w->host_status != GOSTSSL_HOST_YES || w->verify || !done )
+        return 0;
+
+    std::call_once( g_verify_once, verify_pool_start );
+
+    VERIFY_JOB * job = new VERIFY_JOB();
+    job->w = w;
+    job->done = done;
+    job->arg = arg;
+
+    {
+        std::unique_lock<std::mutex> lck( g_verify_mutex );
+        w->verify = job;
+        g_verify_queue.push_back( job );
+    }
+
+    g_verify_cv.notify_one();
+    return 1;
+}
+
+int gostssl_verify_poll( void * s, unsigned * gost_status )
+{
+    GostSSL_Worker * w = workers_api( (SSL *)s, WDB_SEARCH );
+
+    if( !w || !w->verify )
+        return 0;
+
+    std::unique_lock<std::mutex> lck( g_verify_mutex );
+
+    if( !w->verify->is_done || w->verify->is_canceled )
+        return 0;
+
+    *gost_status = w->verify->gost_status;
+    return 1;
+}
+
+void gostssl_verify_cancel( void * s )
+{
+    GostSSL_Worker * w = workers_api( (SSL *)s, WDB_SEARCH );
+
+    if( !w || !w->verify )
+        return;
+
+    std::unique_lock<std::mutex> lck( g_verify_mutex );
+    w->verify->is_canceled = true;
+}
+
+// false if a pool thread still verifies, the worker is left to it
+static bool verify_running( GostSSL_Worker * w )
+{
+    if( !w->verify )
+        return false;
+
+    std::unique_lock<std::mutex> lck( g_verify_mutex );
+
+    return !w->verify->is_done;
+}
+
+static bool verify_release( GostSSL_Worker * w )
+{
+    if( !w->verify )
+        return true;
+
+    std::unique_lock<std::mutex> lck( g_verify_mutex );
+
+    if( w->verify->is_done )
+        return true;
+
+    w->verify->is_canceled = true;
+    w->verify->is_orphan = true;
+    w->s = NULL;
+
+    return false;
+}
+
+// client certificates
+//
+// eligible certificates of the "MY" store are kept in an immutable
+// snapshot, it is rebuilt only when the store changes, when Chromium's
+// certificate database changes (gostssl_keys_flush) or when a certificate
+// crosses its validity period, eligibility is remembered per certificate
+// so a change re-checks new ones only; Windows notifies store changes,
+// elsewhere the CSP keeps the store in a single file and a change of its
+// modification time or size is the signal, a call costs a stat() then,
+// without the file the store is walked every
+// GOSTSSL_CLIENT_CERTS_RESCAN seconds; GOSTSSL_CERT_STORE names the file
+// when the CSP keeps it elsewhere
+
+struct CLIENT_CERTS
+{
+    std::vector<std::string> bufs;
+    std::vector<char *> certs;
+    std::vector<int> lens;
+};
+
+struct CLIENT_CERT_INFO
+{
+    bool is_eligible;
+    uint32_t not_before;
+    uint32_t not_after;
+};
+
+static std::mutex g_client_certs_mutex;
+static std::shared_ptr<const CLIENT_CERTS> g_client_certs;
+static std::map< std::string, CLIENT_CERT_INFO > g_client_certs_index;
+static uint32_t g_client_certs_expires = 0;
+#ifdef _WIN32
+static HCERTSTORE g_client_certs_store = NULL;
+static HANDLE g_client_certs_event = NULL;
+#else
+#define GOSTSSL_CLIENT_CERTS_RESCAN 60
+static std::string g_client_certs_path;
+static bool g_client_certs_path_done = false;
+static uint64_t g_client_certs_stamp = 0;
+#endif
+
+#ifndef _WIN32
+static void client_certs_path( std::string & path )
+{
+    const char * env = getenv( "GOSTSSL_CERT_STORE" );
+
+    if( env && *env )
+    {
+        path = env;
+        return;
+    }
+
+    struct passwd * pw = getpwuid( geteuid() );
+
+    if( !pw || !pw->pw_name )
         return;
 
+    path = "/var/opt/cprocsp/users/";
+    path += pw->pw_name;
+    path += "/stores/my.sto";
+}
+
+// 0 without the store file
+static uint64_t client_certs_stamp()
+{
+    if( !g_client_certs_path_done )
+    {
+        client_certs_path( g_client_certs_path );
+        g_client_certs_path_done = true;
+    }
+
+    struct stat st;
+
+    if( g_client_certs_path.empty() || stat( g_client_certs_path.c_str(), &st ) != 0 )
+        return 0;
+
+    uint64_t h = 14695981039346656037ULL;
+    uint64_t parts[4] = { (uint64_t)st.st_mtim.tv_sec, (uint64_t)st.st_mtim.tv_nsec, (uint64_t)st.st_size, (uint64_t)st.st_ino };
+
+    for( size_t i = 0; i < 4; i++ )
+    {
+        h ^= parts[i];
+        h *= 1099511628211ULL;
+    }
+
+    return h ? h : 1;
+}
+#endif
+
+static const CLIENT_CERT_INFO & client_cert_info( PCCERT_CONTEXT pcert, const std::string & der )
+{
+    auto it = g_client_certs_index.find( der );
+
+    if( it != g_client_certs_index.end() )
+        return it->second;
+
+    BYTE bUsage;
+    DWORD dw = 0;
+    CLIENT_CERT_INFO info;
+
+    // basic cert validation, time validity is checked on every rebuild
+    info.is_eligible =
+        ( CertGetIntendedKeyUsage( X509_ASN_ENCODING, pcert->pCertInfo, &bUsage, 1 ) ) &&
+        ( bUsage & CERT_DIGITAL_SIGNATURE_KEY_USAGE ) &&
+        ( CertGetCertificateContextProperty( pcert, CERT_KEY_PROV_INFO_PROP_ID, NULL, &dw ) );
+    info.not_before = filetime_to_time( pcert->pCertInfo->NotBefore );
+    info.not_after = filetime_to_time( pcert->pCertInfo->NotAfter );
+
+    return g_client_certs_index[der] = info;
+}
+
+static std::shared_ptr<const CLIENT_CERTS> client_certs_get()
+{
+    std::unique_lock<std::mutex> lck( g_client_certs_mutex );
+
+    uint32_t now = (uint32_t)time( NULL );
+    bool is_changed = !g_client_certs || now >= g_client_certs_expires;
+
+#ifdef _WIN32
+    if( !g_client_certs_store )
+    {
+        g_client_certs_store = CertOpenStore( CERT_STORE_PROV_SYSTEM_A, 0, 0, CERT_STORE_OPEN_EXISTING_FLAG | CERT_STORE_READONLY_FLAG, "MY" );
+
+        if( !g_client_certs_store )
+            return std::shared_ptr<const CLIENT_CERTS>();
+
+        g_client_certs_event = CreateEvent( NULL, FALSE, FALSE, NULL );
+
+        if( g_client_certs_event &&
+            !CertControlStore( g_client_certs_store, 0, CERT_STORE_CTRL_NOTIFY_CHANGE, &g_client_certs_event ) )
+        {
+            CloseHandle( g_client_certs_event );
+            g_client_certs_event = NULL;
+        }
+    }
+
+    HCERTSTORE hStore = g_client_certs_store;
+
+    // without notifications every call rebuilds
+    if( !g_client_certs_event || WaitForSingleObject( g_client_certs_event, 0 ) == WAIT_OBJECT_0 )
+    {
+        CertControlStore( hStore, 0, CERT_STORE_CTRL_RESYNC, g_client_certs_event ? &g_client_certs_event : NULL );
+        is_changed = true;
+    }
+#else
+    uint64_t stamp = client_certs_stamp();
+
+    if( stamp != g_client_certs_stamp )
+        is_changed = true;
+#endif
+
+    if( !is_changed )
+    {
+        GOSTSSL_COUNT( client_certs_hits );
+        return g_client_certs;
+    }
+
+#ifndef _WIN32
     HCERTSTORE hStore = CertOpenStore( CERT_STORE_PROV_SYSTEM_A, 0, 0, CERT_STORE_OPEN_EXISTING_FLAG | CERT_STORE_READONLY_FLAG, "MY" );
 
     if( !hStore )
-        return;
+        return std::shared_ptr<const CLIENT_CERTS>();
+#endif
+
+    GOSTSSL_COUNT( client_certs_rebuilds );
 
-    int i = 0;
-    g_certs.clear();
-    g_certlens.clear();
-    g_certbufs.clear();
+    std::shared_ptr<CLIENT_CERTS> certs = std::make_shared<CLIENT_CERTS>();
+    std::map< std::string, CLIENT_CERT_INFO > index;
+    uint32_t expires = 0xFFFFFFFF;
 
     for(
         PCCERT_CONTEXT pcert = CertFindCertificateInStore( hStore, ( PKCS_7_ASN_ENCODING | X509_ASN_ENCODING ), 0, CERT_FIND_ANY, 0, 0 );
         pcert;
         pcert = CertFindCertificateInStore( hStore, ( PKCS_7_ASN_ENCODING | X509_ASN_ENCODING ), 0, CERT_FIND_ANY, 0, pcert ) )
     {
-        BYTE bUsage;
-        DWORD dw = 0;
-        // basic cert validation
-        if( ( CertGetIntendedKeyUsage( X509_ASN_ENCODING, pcert->pCertInfo, &bUsage, 1 ) ) &&
-            ( bUsage & CERT_DIGITAL_SIGNATURE_KEY_USAGE ) &&
-            ( CertVerifyTimeValidity( NULL, pcert->pCertInfo ) == 0 ) &&
-            ( CertGetCertificateContextProperty( pcert, CERT_KEY_PROV_INFO_PROP_ID, NULL, &dw ) ) )
+        std::string der( (char *)pcert->pbCertEncoded, pcert->cbCertEncoded );
+        const CLIENT_CERT_INFO & info = client_cert_info( pcert, der );
+
+        // certificates gone from the store are forgotten
+        index[der] = info;
+
+        if( !info.is_eligible )
+            continue;
+
+        // the snapshot lives until the next validity boundary
+        if( now < info.not_before )
         {
-            g_certbufs.push_back( std::string( (char *)pcert->pbCertEncoded, pcert->cbCertEncoded ) );
-            g_certlens.push_back( (int)g_certbufs[i].size() );
-            g_certs.push_back( &g_certbufs[i][0] );
-            i++;
+            if( info.not_before < expires )
+                expires = info.not_before;
+            continue;
         }
+
+        if( now >= info.not_after )
+            continue;
+
+        if( info.not_after < expires )
+            expires = info.not_after;
+
+        certs->bufs.push_back( der );
     }
 
-    if( i )
+#ifndef _WIN32
+    CertCloseStore( hStore, 0 );
+
+    if( !stamp && now + GOSTSSL_CLIENT_CERTS_RESCAN < expires )
+        expires = now + GOSTSSL_CLIENT_CERTS_RESCAN;
+#endif
+
+    for( size_t i = 0; i < certs->bufs.size(); i++ )
     {
-        *certs = &g_certs[0];
-        *lens = &g_certlens[0];
-        *count = i;
+        certs->certs.push_back( &certs->bufs[i][0] );
+        certs->lens.push_back( (int)certs->bufs[i].size() );
     }
 
-    CertCloseStore( hStore, 0 );
+    g_client_certs_index.swap( index );
+    g_client_certs_expires = expires;
+#ifndef _WIN32
+    g_client_certs_stamp = stamp;
+#endif
+    g_client_certs = certs;
+
+    return g_client_certs;
+}
+
+void gostssl_clientcertshook( char *** certs, int ** lens, int * count, int * is_gost )
+{
+    // the snapshot handed out stays alive until the next call on this thread
+    static thread_local std::shared_ptr<const CLIENT_CERTS> retained;
+
+    *is_gost = g_is_gost;
+    *count = 0;
+
+    if( !g_is_gost )
+        return;
+
+    retained = client_certs_get();
+
+    if( !retained || retained->certs.empty() )
+        return;
+
+    *certs = const_cast<char **>( &retained->certs[0] );
+    *lens = const_cast<int *>( &retained->lens[0] );
+    *count = (int)retained->certs.size();
+}
+
+// private keys
+//
+// msspi takes a client certificate as DER and acquires its key on every
+// handshake, there is no handle gostssl could pass it, so it keeps none;
+// Chromium calls gostssl_keys_flush() when its certificate database
+// changes (a token is inserted or removed), the client certificate
+// snapshot is rebuilt on its next use, whichever |cert| changed
+
+void gostssl_keys_flush( void * cert, int size )
+{
+    std::unique_lock<std::mutex> lck( g_client_certs_mutex );
+
+    g_client_certs.reset();
 }
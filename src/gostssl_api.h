@@ -0,0 +1,128 @@
+#ifndef GOSTSSL_API_H
+#define GOSTSSL_API_H
+
+// gostssl function table
+//
+// gostssl exports a single entry point, gostssl_api( version ), that returns
+// an immutable table of every hook, callers resolve it once instead of
+// looking up each symbol on their own, members are only appended, so
+// |size| tells which of them a newer library provides, an incompatible
+// change bumps GOSTSSL_API_VERSION and older callers get NULL
+//
+// the header is shared by gostssl, BoringSSL and Chromium, define
+// GOSTSSL_API_LOADER before including it for gostssl_api_get()
+
+#ifndef EXPLICITSSL_CALL
+#ifndef _WIN32
+#define EXPLICITSSL_CALL
+#else
+#if defined ( _M_IX86 )
+#define EXPLICITSSL_CALL __cdecl
+#elif defined ( _M_X64 )
+#define EXPLICITSSL_CALL __fastcall
+#endif
+#endif // _WIN32
+#endif // EXPLICITSSL_CALL
+
+#define GOSTSSL_API_VERSION 2
+#define GOSTSSL_API_ENTRY "gostssl_api"
+
+#if defined( __cplusplus )
+extern "C" {
+#endif
+
+struct ssl_st;
+struct boringssl_method_st;
+
+typedef void ( EXPLICITSSL_CALL * gostssl_verify_cb )( void * arg, unsigned gost_status );
+// |is_final| is set once, when the callback is never called again
+typedef void ( EXPLICITSSL_CALL * gostssl_wake_cb )( void * arg, int is_final );
+
+typedef struct gostssl_api_st
+{
+    unsigned version;
+    unsigned size;
+
+    // BoringSSL
+    int  ( EXPLICITSSL_CALL * init )( struct boringssl_method_st * bssl_methods );
+    int  ( EXPLICITSSL_CALL * connect )( struct ssl_st * s, int * is_gost );
+    int  ( EXPLICITSSL_CALL * read )( struct ssl_st * s, void * buf, int len, int * is_gost );
+    int  ( EXPLICITSSL_CALL * write )( struct ssl_st * s, const void * buf, int len, int * is_gost );
+    int  ( EXPLICITSSL_CALL * peek )( struct ssl_st * s, void * buf, int len, int * is_gost );
+    int  ( EXPLICITSSL_CALL * pending )( const struct ssl_st * s, int * is_gost );
+    void ( EXPLICITSSL_CALL * free )( struct ssl_st * s );
+    int  ( EXPLICITSSL_CALL * tls_gost_required )( struct ssl_st * s );
+
+    // Chromium
+    // |domain| is the registrable domain of the hostname (public suffix
+    // list, private registries included), NULL or empty without one
+    void ( EXPLICITSSL_CALL * cachestring )( struct ssl_st * s, const char * cachestring, const char * domain );
+    void ( EXPLICITSSL_CALL * certbind )( void * s, void * cert, int size );
+    void ( EXPLICITSSL_CALL * verifyhook )( void * s, unsigned * is_gost );
+    void ( EXPLICITSSL_CALL * clientcertshook )( char *** certs, int ** lens, int * count, int * is_gost );
+    void ( EXPLICITSSL_CALL * isgostcerthook )( void * cert, int size, int * is_gost );
+    int  ( EXPLICITSSL_CALL * verify_start )( void * s, gostssl_verify_cb done, void * arg );
+    int  ( EXPLICITSSL_CALL * verify_poll )( void * s, unsigned * gost_status );
+    void ( EXPLICITSSL_CALL * verify_cancel )( void * s );
+    void ( EXPLICITSSL_CALL * verify_invalidate )( const char * hostname );
+    void ( EXPLICITSSL_CALL * keys_flush )( void * cert, int size );
+    void ( EXPLICITSSL_CALL * counters )( const char *** names, unsigned long long ** values, int * count );
+    int  ( EXPLICITSSL_CALL * handshake_wake )( struct ssl_st * s, gostssl_wake_cb wake, void * arg );
+    // 1 with a usable CSP, 0 while it is probed, -1 without one
+    int  ( EXPLICITSSL_CALL * csp_state )( void );
+}
+GOSTSSL_API;
+
+typedef const GOSTSSL_API * ( EXPLICITSSL_CALL * gostssl_api_fn )( unsigned version );
+
+#if defined( __cplusplus )
+}
+#endif
+
+#if defined( GOSTSSL_API_LOADER ) && defined( __cplusplus )
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#define GOSTSSL_API_LIB "gostssl.dll"
+#else
+#include <dlfcn.h>
+#define GOSTSSL_API_LIB "gostssl.so"
+#endif // _WIN32
+
+// the table of the loaded gostssl or NULL, resolved once on first use
+// (thread-safe static initialization), inline so every caller shares it
+inline const GOSTSSL_API * gostssl_api_get()
+{
+    static const GOSTSSL_API * api = []() -> const GOSTSSL_API *
+    {
+        gostssl_api_fn entry = NULL;
+
+#ifdef _WIN32
+        HMODULE hGSSL = LoadLibraryA( GOSTSSL_API_LIB );
+
+        if( hGSSL )
+            *(uintptr_t *)&entry = (uintptr_t)GetProcAddress( hGSSL, GOSTSSL_API_ENTRY );
+#else
+        void * hGSSL = dlopen( GOSTSSL_API_LIB, RTLD_LAZY );
+
+        if( hGSSL )
+            *(uintptr_t *)&entry = (uintptr_t)dlsym( hGSSL, GOSTSSL_API_ENTRY );
+#endif // _WIN32
+
+        const GOSTSSL_API * table = entry ? entry( GOSTSSL_API_VERSION ) : NULL;
+
+        if( !table || table->version != GOSTSSL_API_VERSION || table->size < sizeof( GOSTSSL_API ) )
+            return NULL;
+
+        return table;
+    }();
+
+    return api;
+}
+
+#endif // GOSTSSL_API_LOADER
+
+#endif // GOSTSSL_API_H
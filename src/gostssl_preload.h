@@ -0,0 +1,15 @@
+// generated by gostssl_preload.py from gostssl_preload.txt, do not edit
+
+#define GOSTSSL_PRELOAD_COUNT 0
+#define GOSTSSL_PRELOAD_BUCKETS 1
+#define GOSTSSL_PRELOAD_SLOTS 1
+
+static constexpr uint32_t g_preload_seeds[GOSTSSL_PRELOAD_BUCKETS] =
+{
+    0u,
+};
+
+static constexpr PRELOAD_ENTRY g_preload[GOSTSSL_PRELOAD_SLOTS] =
+{
+    { "", 0, 0 },
+};
@@ -0,0 +1,104 @@
+#!/usr/bin/env python3
+#
+# Generates gostssl_preload.h from gostssl_preload.txt
+#
+# The list is compiled into a hash and displace perfect hash:
+# a key goes to bucket fnv( key, FNV_BASIS ) % buckets and to slot
+# fnv( key, seeds[bucket] ) % slots, seeds are chosen so that no two keys
+# share a slot. Suffix entries (".example") are stored without the dot
+# and flagged, so a lookup probes the host and each of its parent domains.
+#
+# usage: gostssl_preload.py [gostssl_preload.txt [gostssl_preload.h]]
+
+import os
+import sys
+
+FNV_BASIS = 2166136261
+FNV_PRIME = 16777619
+KEY_MAX = 253
+
+def fnv( key, h ):
+    for c in key.encode( 'ascii' ):
+        h = ( ( h ^ c ) * FNV_PRIME ) & 0xFFFFFFFF
+    return h
+
+def load( path ):
+    entries = {}
+    with open( path ) as f:
+        for n, line in enumerate( f, 1 ):
+            line = line.split( '#', 1 )[0].strip().lower()
+            if not line:
+                continue
+            is_suffix = line.startswith( '.' )
+            key = line.lstrip( '.' )
+            if not key or len( key ) > KEY_MAX or any( c not in 'abcdefghijklmnopqrstuvwxyz0123456789-.' for c in key ):
+                sys.exit( '%s:%d: bad entry "%s"' % ( path, n, line ) )
+            # a suffix entry covers the exact one
+            entries[key] = entries.get( key, False ) or is_suffix
+    return sorted( entries.items() )
+
+def build( entries ):
+    count = len( entries )
+    slots = max( 1, count + count // 4 )
+    buckets = max( 1, ( count + 3 ) // 4 )
+    table = [None] * buckets
+    for i in range( buckets ):
+        table[i] = []
+    for key, is_suffix in entries:
+        table[fnv( key, FNV_BASIS ) % buckets].append( ( key, is_suffix ) )
+
+    seeds = [0] * buckets
+    keys = [None] * slots
+    for b in sorted( range( buckets ), key = lambda b: -len( table[b] ) ):
+        if not table[b]:
+            break
+        seed = 1
+        while True:
+            pos = [fnv( key, seed ) % slots for key, _ in table[b]]
+            if len( set( pos ) ) == len( pos ) and all( keys[p] is None for p in pos ):
+                break
+            seed += 1
+        seeds[b] = seed
+        for p, entry in zip( pos, table[b] ):
+            keys[p] = entry
+    return seeds, keys
+
+def write( path, source, seeds, keys ):
+    out = []
+    out.append( '// generated by gostssl_preload.py from %s, do not edit' % os.path.basename( source ) )
+    out.append( '' )
+    out.append( '#define GOSTSSL_PRELOAD_COUNT %d' % sum( 1 for entry in keys if entry ) )
+    out.append( '#define GOSTSSL_PRELOAD_BUCKETS %d' % len( seeds ) )
+    out.append( '#define GOSTSSL_PRELOAD_SLOTS %d' % len( keys ) )
+    out.append( '' )
+    out.append( 'static constexpr uint32_t g_preload_seeds[GOSTSSL_PRELOAD_BUCKETS] =' )
+    out.append( '{' )
+    for i in range( 0, len( seeds ), 8 ):
+        out.append( '    ' + ' '.join( '%uu,' % s for s in seeds[i:i + 8] ) )
+    out.append( '};' )
+    out.append( '' )
+    out.append( 'static constexpr PRELOAD_ENTRY g_preload[GOSTSSL_PRELOAD_SLOTS] =' )
+    out.append( '{' )
+    for entry in keys:
+        if entry:
+            out.append( '    { "%s", %d, %d },' % ( entry[0], len( entry[0] ), int( entry[1] ) ) )
+        else:
+            out.append( '    { "", 0, 0 },' )
+    out.append( '};' )
+    out.append( '' )
+    # the compiler checks that its hash agrees with ours
+    for i, entry in enumerate( keys ):
+        if entry:
+            key = entry[0]
+            b = fnv( key, FNV_BASIS ) % len( seeds )
+            out.append( 'static_assert( preload_hash( "%s", %d, %uu ) %% GOSTSSL_PRELOAD_BUCKETS == %d &&' % ( key, len( key ), FNV_BASIS, b ) )
+            out.append( '               preload_hash( "%s", %d, %uu ) %% GOSTSSL_PRELOAD_SLOTS == %d, "preload hash mismatch" );' % ( key, len( key ), seeds[b], i ) )
+    with open( path, 'w' ) as f:
+        f.write( '\n'.join( out ).rstrip() + '\n' )
+
+if __name__ == '__main__':
+    here = os.path.dirname( os.path.abspath( __file__ ) )
+    source = sys.argv[1] if len( sys.argv ) > 1 else os.path.join( here, 'gostssl_preload.txt' )
+    target = sys.argv[2] if len( sys.argv ) > 2 else os.path.join( here, 'gostssl_preload.h' )
+    seeds, keys = build( load( source ) )
+    write( target, source, seeds, keys )